@@ -0,0 +1,219 @@
+/* housesensor - A simple home web server for measurements.
+ *
+ * Copyright 2019, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * db_bench.c - Micro-benchmarks for the sensor database.
+ *
+ * SYNOPSIS:
+ *
+ * db_bench -config=<file> [-sensors=N] [-depth=N]
+ *
+ *    Load the configuration, then measure the main database operations.
+ *    The configuration must declare N w1 sensors with devices named
+ *    28-<index in hexadecimal, 12 digits> (see db_bench.sh). The depth is
+ *    only reported, since it is set in the configuration.
+ *
+ *    Each result is printed as one JSON object per line, with the name
+ *    of the operation, the number of sensors, the ring depth, the number
+ *    of operations, the total time and the time per operation.
+ *
+ *    The database background processing (which writes the journal) runs
+ *    once per second during the measurements, as in the service.
+ *
+ * The database can only be initialized once per process, so each run
+ * covers one configuration.
+ */
+
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "housesensor_db.h"
+
+
+static int Sensors = 0;
+static int Depth = 0;
+
+static double Now (void) {
+    struct timespec t;
+    clock_gettime (CLOCK_MONOTONIC, &t);
+    return t.tv_sec + (t.tv_nsec / 1e9);
+}
+
+static void Report (const char *name, long count, double elapsed) {
+    printf ("{\"bench\":\"%s\",\"sensors\":%d,\"depth\":%d,"
+                "\"count\":%ld,\"seconds\":%.6f,\"ns_per_op\":%.1f}\n",
+            name, Sensors, Depth, count, elapsed, (elapsed * 1e9) / count);
+}
+
+// Run each operation for about this time, in seconds.
+//
+#define BENCH_DURATION 0.5
+
+// Run the database background processing once per second, as the
+// service's main loop does.
+//
+static void Background (void) {
+
+    static time_t Last = 0;
+    time_t now = time(0);
+
+    if (now == Last) return;
+    housesensor_db_background (now);
+    Last = now;
+}
+
+int main (int argc, const char **argv) {
+
+    char (*devices)[32];
+    int *handles;
+    const char *value;
+    double start;
+    double elapsed;
+    long count;
+    long total;
+    int i;
+
+    for (i = 1; i < argc; ++i) {
+        if (!strncmp (argv[i], "-sensors=", 9)) Sensors = atoi (argv[i]+9);
+        if (!strncmp (argv[i], "-depth=", 7)) Depth = atoi (argv[i]+7);
+    }
+    if (Sensors <= 0) {
+        fprintf (stderr, "Missing -sensors option\n");
+        return 1;
+    }
+
+    start = Now ();
+    housesensor_db_initialize (argc, argv);
+    Report ("load_config", 1, Now() - start);
+
+    devices = calloc (Sensors, sizeof(*devices));
+    handles = calloc (Sensors, sizeof(*handles));
+    if (!devices || !handles) {
+        fprintf (stderr, "No enough memory for %d sensors\n", Sensors);
+        return 1;
+    }
+    for (i = 0; i < Sensors; ++i) {
+        snprintf (devices[i], sizeof(devices[i]), "28-%012x", i);
+        handles[i] = housesensor_db_handle ("w1", devices[i]);
+        if (handles[i] < 0) {
+            fprintf (stderr, "Sensor %s is not configured\n", devices[i]);
+            return 1;
+        }
+    }
+
+    // Set a value by driver and device name, as text.
+    //
+    total = 0;
+    start = Now ();
+    do {
+        for (count = 0; count < 10000; ++count) {
+            housesensor_db_set ("w1", devices[(total+count) % Sensors],
+                                ((total+count) & 1) ? "21.5" : "22.062", "C");
+        }
+        total += count;
+        Background ();
+        elapsed = Now() - start;
+    } while (elapsed < BENCH_DURATION);
+    Report ("set", total, elapsed);
+
+    // Set a value by handle, as a number: what the w1 driver does.
+    //
+    total = 0;
+    start = Now ();
+    do {
+        for (count = 0; count < 10000; ++count) {
+            housesensor_db_set_number (handles[(total+count) % Sensors],
+                                       21000 + (count & 1023), 3, "C");
+        }
+        total += count;
+        Background ();
+        elapsed = Now() - start;
+    } while (elapsed < BENCH_DURATION);
+    Report ("set_number", total, elapsed);
+
+    // The status when nothing changed since the last request.
+    //
+    housesensor_db_latest ();
+    total = 0;
+    start = Now ();
+    do {
+        for (count = 0; count < 100; ++count) {
+            value = housesensor_db_latest ();
+        }
+        total += count;
+        Background ();
+        elapsed = Now() - start;
+    } while (elapsed < BENCH_DURATION);
+    Report ("latest_unchanged", total, elapsed);
+
+    // The status after one sensor changed.
+    //
+    total = 0;
+    start = Now ();
+    do {
+        for (count = 0; count < 100; ++count) {
+            housesensor_db_set_number (handles[(total+count) % Sensors],
+                                       20000 + count, 3, "C");
+            value = housesensor_db_latest ();
+        }
+        total += count;
+        Background ();
+        elapsed = Now() - start;
+    } while (elapsed < BENCH_DURATION);
+    Report ("latest_changed", total, elapsed);
+
+    // The whole ring of recent measurements (the ring is full by now).
+    //
+    total = 0;
+    start = Now ();
+    do {
+        for (count = 0; count < 10; ++count) {
+            value = housesensor_db_recent (0);
+        }
+        total += count;
+        Background ();
+        elapsed = Now() - start;
+    } while (elapsed < BENCH_DURATION);
+    Report ("recent_all", total, elapsed);
+
+    // Only the measurements since the previous request: a client polling
+    // after one new measurement.
+    //
+    value = strstr (housesensor_db_recent (0), "\"next\":");
+    total = 0;
+    start = Now ();
+    if (value) {
+        long long since = atoll (value + 7);
+        do {
+            for (count = 0; count < 1000; ++count) {
+                housesensor_db_set_number (handles[count % Sensors],
+                                           20000, 3, "C");
+                housesensor_db_recent (since++);
+            }
+            total += count;
+            Background ();
+            elapsed = Now() - start;
+        } while (elapsed < BENCH_DURATION);
+        Report ("recent_since", total, elapsed);
+    }
+    return 0;
+}
+
@@ -0,0 +1,44 @@
+#!/bin/sh
+#
+# housesensor - A simple home web server for sensor measurement.
+#
+# Copyright 2023, Pascal Martin
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public License
+# as published by the Free Software Foundation; either version 2
+# of the License, or (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor,
+# Boston, MA  02110-1301, USA.
+#
+#
+# db_bench.sh - Run the database micro-benchmarks for several sizes.
+#
+# The results are printed as JSON, one object per line. The sizes can
+# be changed using the SENSORS and DEPTHS environment variables.
+
+BENCH=`dirname $0`
+WORK=`mktemp -d /tmp/housesensor-bench.XXXXXX`
+trap "rm -rf $WORK" EXIT INT TERM
+
+for sensors in ${SENSORS:-10 1000 10000} ; do
+    for depth in ${DEPTHS:-1024 8192 65536} ; do
+        # Each run starts from an empty log and archive.
+        rm -rf $WORK/housesensor.csv $WORK/archive
+        mkdir $WORK/archive
+        CONFIG=$WORK/sensor.config
+        echo "OPTION recent.depth $depth" > $CONFIG
+        echo "OPTION log.file $WORK/housesensor.csv" >> $CONFIG
+        echo "OPTION archive.directory $WORK/archive" >> $CONFIG
+        awk "BEGIN {for (i = 0; i < $sensors; ++i) printf \"w1 28-%012x room%d sensor%d C\\n\", i, i % 50, i}" >> $CONFIG
+        $BENCH/db_bench -config=$CONFIG -sensors=$sensors -depth=$depth || exit 1
+    done
+done
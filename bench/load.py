@@ -0,0 +1,161 @@
+#!/usr/bin/env python3
+#
+# housesensor - A simple home web server for sensor measurement.
+#
+# Copyright 2023, Pascal Martin
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public License
+# as published by the Free Software Foundation; either version 2
+# of the License, or (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor,
+# Boston, MA  02110-1301, USA.
+#
+#
+# load.py - Drive a running HouseSensor service and report its performance.
+#
+# This measures:
+# - the scan duration: the time until every sensor has a value, and
+#   the rate of measurements once all sensors have been read,
+# - the latency of the web requests, issued by concurrent clients,
+# - the memory used by the service (from /proc).
+
+import argparse
+import http.client
+import json
+import threading
+import time
+
+
+def get (connection, uri):
+    connection.request ('GET', uri)
+    response = connection.getresponse ()
+    return response.status, response.read ()
+
+
+def wait_for_scan (port, devices, timeout):
+    start = time.time ()
+    connection = http.client.HTTPConnection ('localhost', port, timeout=10)
+    while time.time () < start + timeout:
+        status, body = get (connection, '/sensor/status')
+        if status == 200:
+            sensors = json.loads (body.decode ('utf-8', 'replace'))['sensor']
+            valued = sum (1 for location in sensors.values ()
+                            for s in location if 'timestamp' in s)
+            if valued >= devices:
+                return time.time () - start
+        time.sleep (0.2)
+    return None
+
+
+def measurement_rate (port, duration):
+    connection = http.client.HTTPConnection ('localhost', port, timeout=10)
+    status, body = get (connection, '/sensor/recent?since=0')
+    first = json.loads (body.decode ('utf-8', 'replace'))['sensor']['next']
+    time.sleep (duration)
+    status, body = get (connection, '/sensor/recent?since=%d' % first)
+    last = json.loads (body.decode ('utf-8', 'replace'))['sensor']['next']
+    return (last - first) / duration
+
+
+def client (port, uris, deadline, latencies, errors):
+    connection = http.client.HTTPConnection ('localhost', port, timeout=10)
+    i = 0
+    while time.time () < deadline:
+        uri = uris[i % len(uris)]
+        i += 1
+        start = time.time ()
+        try:
+            status, body = get (connection, uri)
+        except Exception:
+            errors[uri] = errors.get (uri, 0) + 1
+            connection.close ()
+            connection = http.client.HTTPConnection ('localhost', port, timeout=10)
+            continue
+        elapsed = time.time () - start
+        if status != 200:
+            errors[uri] = errors.get (uri, 0) + 1
+        latencies.setdefault (uri, []).append (elapsed)
+
+
+def percentile (values, p):
+    index = min (len(values) - 1, int (len(values) * p / 100))
+    return values[index]
+
+
+def memory (pid):
+    usage = {}
+    try:
+        with open ('/proc/%d/status' % pid) as f:
+            for line in f:
+                name, value = line.split (':', 1)
+                if name in ('VmRSS', 'VmHWM', 'VmSize'):
+                    usage[name] = value.strip ()
+    except OSError:
+        pass
+    return usage
+
+
+def main ():
+    parser = argparse.ArgumentParser (description='HouseSensor load test.')
+    parser.add_argument ('--port', type=int, required=True)
+    parser.add_argument ('--pid', type=int, default=0,
+                         help='the process ID of the service, for memory use')
+    parser.add_argument ('--devices', type=int, required=True)
+    parser.add_argument ('--clients', type=int, default=8)
+    parser.add_argument ('--duration', type=float, default=30,
+                         help='duration of the load, in seconds')
+    args = parser.parse_args ()
+
+    scan = wait_for_scan (args.port, args.devices, 600)
+    if scan is None:
+        print ('scan: not all %d sensors were read' % args.devices)
+    else:
+        print ('scan: all %d sensors read in %.1f seconds' % (args.devices, scan))
+
+    now = int (time.time ())
+    uris = ['/sensor/status',
+            '/sensor/recent',
+            '/sensor/history',
+            '/sensor/query?location=room1&from=%d&to=%d' % (now - 3600, now)]
+
+    latencies = {}
+    errors = {}
+    deadline = time.time () + args.duration
+    threads = [threading.Thread (target=client,
+                                 args=(args.port, uris, deadline,
+                                       latencies, errors))
+               for i in range (args.clients)]
+    for t in threads:
+        t.start ()
+    rate = measurement_rate (args.port, args.duration / 2)
+    for t in threads:
+        t.join ()
+
+    print ('measurements: %.1f per second' % rate)
+    print ('%-40s %8s %8s %8s %8s %8s %6s' %
+           ('request', 'count', 'p50 ms', 'p90 ms', 'p99 ms', 'max ms', 'errors'))
+    for uri in uris:
+        values = sorted (latencies.get (uri, [0]))
+        print ('%-40s %8d %8.2f %8.2f %8.2f %8.2f %6d' %
+               (uri.split ('&')[0], len (latencies.get (uri, [])),
+                percentile (values, 50) * 1000,
+                percentile (values, 90) * 1000,
+                percentile (values, 99) * 1000,
+                values[-1] * 1000, errors.get (uri, 0)))
+
+    if args.pid:
+        usage = memory (args.pid)
+        print ('memory: %s' % ', '.join ('%s %s' % (k, v) for k, v in usage.items ()))
+
+
+if __name__ == '__main__':
+    main ()
@@ -0,0 +1,72 @@
+#!/bin/sh
+#
+# housesensor - A simple home web server for sensor measurement.
+#
+# Copyright 2023, Pascal Martin
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public License
+# as published by the Free Software Foundation; either version 2
+# of the License, or (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor,
+# Boston, MA  02110-1301, USA.
+#
+#
+# run.sh - Run HouseSensor against a simulated 1-Wire tree, under load.
+#
+# The parameters are environment variables:
+#   DEVICES   number of simulated sensors (default: 2000).
+#   BUSES     number of simulated bus masters (default: 8).
+#   LATENCY   conversion time in milliseconds (default: 750).
+#   JITTER    maximum conversion time variation in milliseconds (default: 50).
+#   FAILURES  rate of CRC failures (default: 0.01).
+#   PERIOD    the w1.scan.period option (default: 10).
+#   CLIENTS   number of concurrent HTTP clients (default: 8).
+#   DURATION  duration of the HTTP load in seconds (default: 30).
+#   PORT      the HTTP port used by HouseSensor (default: 8199).
+#
+# All the files are created in a temporary directory: this does not
+# interfere with an installed HouseSensor service.
+
+BENCH=`dirname $0`
+WORK=`mktemp -d /tmp/housesensor-bench.XXXXXX`
+
+DEVICES=${DEVICES:-2000}
+PORT=${PORT:-8199}
+
+cleanup () {
+    if [ -n "$SERVICE" ] ; then kill $SERVICE 2>/dev/null ; fi
+    if [ -n "$SIMULATOR" ] ; then kill $SIMULATOR 2>/dev/null ; fi
+    wait 2>/dev/null
+    rm -rf $WORK
+}
+trap cleanup EXIT INT TERM
+
+python3 $BENCH/w1sim.py --root $WORK/w1 --config $WORK/sensor.config \
+        --devices $DEVICES --buses ${BUSES:-8} \
+        --latency ${LATENCY:-750} --jitter ${JITTER:-50} \
+        --crc-failure ${FAILURES:-0.01} --period ${PERIOD:-10} \
+        > $WORK/w1sim.log 2>&1 &
+SIMULATOR=$!
+
+# Wait for the simulated tree and configuration to be ready.
+for i in 1 2 3 4 5 6 7 8 9 10 ; do
+    if grep -q ready $WORK/w1sim.log 2>/dev/null ; then break ; fi
+    sleep 1
+done
+
+$BENCH/../housesensor -config=$WORK/sensor.config -http-service=$PORT \
+        > $WORK/housesensor.log 2>&1 &
+SERVICE=$!
+sleep 1
+
+python3 $BENCH/load.py --port $PORT --pid $SERVICE --devices $DEVICES \
+        --clients ${CLIENTS:-8} --duration ${DURATION:-30}
@@ -0,0 +1,75 @@
+/* housesensor - A simple home web server for measurements.
+ *
+ * Copyright 2019, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * stubs.c - The echttp and houseportal functions used by the database.
+ *
+ * SYNOPSIS:
+ *
+ * This replaces the echttp and houseportal libraries, so that the
+ * database module can be benchmarked without a web server. Only the
+ * functions used by the database and the modules it depends on are
+ * provided.
+ */
+
+#include <string.h>
+
+#include "echttp.h"
+#include "echttp_libc.h"
+#include "houseportalclient.h"
+
+int echttp_isdebug (void) {
+    return 0;
+}
+
+int echttp_option_match (const char *reference,
+                         const char *input, const char **value) {
+
+    size_t length = strlen(reference);
+
+    if (strncmp (reference, input, length)) return 0;
+    *value = input + length;
+    return 1;
+}
+
+void echttp_content_type_set (const char *value) { }
+
+void echttp_error (int code, const char *message) { }
+
+void echttp_transfer (int fd, int size) { }
+
+void echttp_listen (int fd, int mode,
+                    echttp_listener *listener, int premium) { }
+
+void echttp_forget (int fd) { }
+
+int echttp_port (int ip) {
+    return 0;
+}
+
+char *strtcpy (char *t, const char *s, int size) {
+    strncpy (t, s, size);
+    t[size-1] = 0;
+    return t;
+}
+
+const char *houseportal_server (void) {
+    return "localhost";
+}
+
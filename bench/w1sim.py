@@ -0,0 +1,149 @@
+#!/usr/bin/env python3
+#
+# housesensor - A simple home web server for sensor measurement.
+#
+# Copyright 2023, Pascal Martin
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public License
+# as published by the Free Software Foundation; either version 2
+# of the License, or (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor,
+# Boston, MA  02110-1301, USA.
+#
+#
+# w1sim.py - Simulate the Linux 1-Wire sysfs tree.
+#
+# This creates a tree that looks like /sys/bus/w1/devices, with the
+# specified number of DS18B20 sensors spread over several bus masters,
+# and a matching HouseSensor configuration file. Each w1_slave file is
+# a named pipe: a thread waits for HouseSensor to open it, sleeps for the
+# simulated conversion time, then writes the usual two lines (with a
+# CRC failure at the specified rate).
+#
+# The tree looks like this:
+#   <root>/devices/28-xxxxxxxxxxxx -> ../masters/w1_bus_masterN/28-xxxxxxxxxxxx
+#   <root>/devices/w1_bus_masterN -> ../masters/w1_bus_masterN
+#   <root>/masters/w1_bus_masterN/28-xxxxxxxxxxxx/w1_slave
+#
+# The program runs until killed.
+
+import argparse
+import os
+import random
+import signal
+import sys
+import threading
+import time
+
+
+def device_id (index):
+    return '28-%012x' % (0x10000 + index)
+
+
+def build (root, devices, buses):
+    os.makedirs (os.path.join (root, 'devices'), exist_ok=True)
+    for b in range (1, buses+1):
+        master = 'w1_bus_master%d' % b
+        os.makedirs (os.path.join (root, 'masters', master), exist_ok=True)
+        link = os.path.join (root, 'devices', master)
+        if not os.path.islink (link):
+            os.symlink (os.path.join ('..', 'masters', master), link)
+
+    paths = []
+    for i in range (devices):
+        master = 'w1_bus_master%d' % (1 + (i % buses))
+        device = device_id (i)
+        folder = os.path.join (root, 'masters', master, device)
+        os.makedirs (folder, exist_ok=True)
+        slave = os.path.join (folder, 'w1_slave')
+        if not os.path.exists (slave):
+            os.mkfifo (slave)
+        link = os.path.join (root, 'devices', device)
+        if not os.path.islink (link):
+            os.symlink (os.path.join ('..', 'masters', master, device), link)
+        paths.append (slave)
+    return paths
+
+
+def configure (path, root, devices, period):
+    with open (path, 'w') as f:
+        f.write ('OPTION w1.root %s\n' % os.path.join (root, 'devices'))
+        f.write ('OPTION w1.scan.period %d\n' % period)
+        f.write ('OPTION log.file %s\n' % os.path.join (root, 'housesensor.csv'))
+        f.write ('OPTION archive.directory %s\n' % os.path.join (root, 'archive'))
+        for i in range (devices):
+            f.write ('w1 %s room%d sensor%d\n' % (device_id (i), i % 50, i))
+    os.makedirs (os.path.join (root, 'archive'), exist_ok=True)
+
+
+def serve (path, latency, jitter, failure, stats):
+    temperature = random.randint (15000, 25000)
+    while True:
+        try:
+            fd = os.open (path, os.O_WRONLY) # Wait for a reader.
+        except OSError:
+            time.sleep (0.1)
+            continue
+        delay = latency + random.uniform (-jitter, jitter)
+        if delay > 0:
+            time.sleep (delay / 1000.0)
+        temperature += random.randint (-62, 62)
+        raw = (temperature * 16 // 1000) & 0xffff
+        scratchpad = '%02x %02x 4b 46 7f ff 0c 10 1c' % (raw & 0xff, raw >> 8)
+        crc = 'NO' if random.random() < failure else 'YES'
+        text = '%s : crc=1c %s\n%s t=%d\n' % (scratchpad, crc, scratchpad, temperature)
+        try:
+            os.write (fd, text.encode())
+            stats[0] += 1
+        except OSError:
+            pass # The reader gave up.
+        os.close (fd)
+
+
+def main ():
+    parser = argparse.ArgumentParser (description='Simulate a 1-Wire sysfs tree.')
+    parser.add_argument ('--root', required=True)
+    parser.add_argument ('--devices', type=int, default=1000)
+    parser.add_argument ('--buses', type=int, default=4)
+    parser.add_argument ('--latency', type=float, default=750,
+                         help='conversion time, in milliseconds')
+    parser.add_argument ('--jitter', type=float, default=50,
+                         help='maximum latency variation, in milliseconds')
+    parser.add_argument ('--crc-failure', type=float, default=0.01,
+                         help='rate of reads that fail the CRC check')
+    parser.add_argument ('--period', type=int, default=10,
+                         help='the w1.scan.period option')
+    parser.add_argument ('--config', required=True,
+                         help='the HouseSensor configuration file to generate')
+    args = parser.parse_args ()
+
+    paths = build (args.root, args.devices, args.buses)
+    configure (args.config, args.root, args.devices, args.period)
+
+    signal.signal (signal.SIGPIPE, signal.SIG_IGN)
+    threading.stack_size (256 * 1024)
+    stats = [0]
+    for path in paths:
+        t = threading.Thread (target=serve, daemon=True,
+                              args=(path, args.latency, args.jitter,
+                                    args.crc_failure, stats))
+        t.start ()
+
+    print ('w1sim: %d devices on %d buses ready' % (args.devices, args.buses),
+           flush=True)
+    while True:
+        time.sleep (10)
+        print ('w1sim: %d reads served' % stats[0], flush=True)
+
+
+if __name__ == '__main__':
+    main ()
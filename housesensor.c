@@ -27,13 +27,30 @@
 #include <fcntl.h>
 
 #include "housesensor.h"
-#include "housesensor_w1.h"
+#include "housesensor_driver.h"
 #include "housesensor_db.h"
+#include "housesensor_archive.h"
+#include "housesensor_query.h"
+#include "housesensor_metrics.h"
+#include "housesensor_stream.h"
 
 #include "echttp_static.h"
 #include "houseportalclient.h"
 
 
+// The time taken to build each JSON response.
+//
+static housesensor_histogram hs_render_status;
+static housesensor_histogram hs_render_recent;
+static housesensor_histogram hs_render_history;
+static housesensor_histogram hs_render_query;
+
+static const char *hs_rendered (housesensor_histogram *h,
+                                long long start, const char *response) {
+    housesensor_metrics_observe (h, housesensor_metrics_now() - start);
+    return response;
+}
+
 static void hs_help (const char *argv0) {
 
     int i = 1;
@@ -56,22 +73,122 @@ static void hs_help (const char *argv0) {
 static const char *hs_sensor_status (const char *method, const char *uri,
                                      const char *data, int length) {
 
+    long long start = housesensor_metrics_now ();
+    const char *tag = housesensor_db_latest_tag ();
+    const char *match = echttp_attribute_get ("If-None-Match");
+
+    echttp_attribute_set ("ETag", tag);
+    if (match && strcmp (match, tag) == 0) {
+        echttp_error (304, "Not Modified");
+        return "";
+    }
     echttp_content_type_json ();
-    return housesensor_db_latest();
+    return hs_rendered (&hs_render_status, start, housesensor_db_latest());
 }
 
 static const char *hs_sensor_recent (const char *method, const char *uri,
                                      const char *data, int length) {
 
+    long long start = housesensor_metrics_now ();
+    const char *since = echttp_parameter_get ("since");
+
     echttp_content_type_json ();
-    return housesensor_db_recent();
+    return hs_rendered (&hs_render_recent, start,
+                        housesensor_db_recent (since ? atoll(since) : 0));
 }
 
 static const char *hs_sensor_history (const char *method, const char *uri,
                                       const char *data, int length) {
 
+    long long start = housesensor_metrics_now ();
+    const char *limit = echttp_parameter_get ("limit");
+
     echttp_content_type_json ();
-    return housesensor_db_history();
+    return hs_rendered (&hs_render_history, start,
+                        housesensor_db_history (echttp_parameter_get ("from"),
+                                                echttp_parameter_get ("to"),
+                                                limit ? atoi(limit) : -1));
+}
+
+static const char *hs_sensor_query (const char *method, const char *uri,
+                                    const char *data, int length) {
+
+    long long start = housesensor_metrics_now ();
+    const char *from = echttp_parameter_get ("from");
+    const char *to = echttp_parameter_get ("to");
+    const char *step = echttp_parameter_get ("step");
+
+    echttp_content_type_json ();
+    return hs_rendered (&hs_render_query, start,
+                        housesensor_query (echttp_parameter_get ("location"),
+                                           echttp_parameter_get ("name"),
+                                           from ? (time_t)atoll(from) : 0,
+                                           to ? (time_t)atoll(to) : 0,
+                                           step ? atoi(step) : 0));
+}
+
+static const char *hs_sensor_records (const char *method, const char *uri,
+                                      const char *data, int length) {
+
+    return housesensor_archive_records (uri + strlen("/sensor/records"));
+}
+
+// The stream is served on its own socket: redirect the client there,
+// using the same host name it used to reach this server.
+//
+static const char *hs_sensor_stream (const char *method, const char *uri,
+                                     const char *data, int length) {
+
+    const char *host = echttp_attribute_get ("Host");
+    const char *colon;
+    char url[512];
+    int hostlength;
+
+    if (!housesensor_stream_port ()) {
+        echttp_error (503, "Service Unavailable");
+        return "";
+    }
+    if (!host) host = "localhost";
+
+    // Remove the port, if any. (An IPv6 address ends with ']'.)
+    //
+    hostlength = strlen(host);
+    colon = strrchr (host, ':');
+    if (colon && !strchr (colon, ']')) hostlength = colon - host;
+
+    snprintf (url, sizeof(url), "http://%.*s:%d/sensor/stream",
+              hostlength, host, housesensor_stream_port ());
+    echttp_attribute_set ("Location", url);
+    echttp_error (307, "Temporary Redirect");
+    return "";
+}
+
+static const char *hs_sensor_metrics (const char *method, const char *uri,
+                                      const char *data, int length) {
+
+    const char *format = echttp_parameter_get ("format");
+    int json = (format && strcmp (format, "json") == 0);
+
+    housesensor_metrics_start (json);
+
+    housesensor_metrics_declare ("housesensor_http_render_seconds",
+                                 "histogram",
+                                 "Time to build a JSON response.");
+    housesensor_metrics_histogram ("endpoint", "status", &hs_render_status);
+    housesensor_metrics_histogram ("endpoint", "recent", &hs_render_recent);
+    housesensor_metrics_histogram ("endpoint", "history", &hs_render_history);
+    housesensor_metrics_histogram ("endpoint", "query", &hs_render_query);
+
+    housesensor_db_metrics ();
+    housesensor_archive_metrics ();
+    housesensor_stream_metrics ();
+    housesensor_driver_metrics ();
+
+    if (json)
+        echttp_content_type_json ();
+    else
+        echttp_content_type_set ("text/plain; version=0.0.4");
+    return housesensor_metrics_end ();
 }
 
 static void hs_background (int fd, int mode) {
@@ -79,8 +196,9 @@ static void hs_background (int fd, int mode) {
     time_t now = time(0);
 
     houseportal_background (now);
-    housesensor_w1_background (now);
+    housesensor_driver_background (now);
     housesensor_db_background (now);
+    housesensor_stream_background (now);
 }
 
 int main (int argc, const char **argv) {
@@ -100,11 +218,12 @@ int main (int argc, const char **argv) {
     }
 
     housesensor_db_initialize (argc, argv);
-    housesensor_w1_initialize (argc, argv);
 
     echttp_default ("-http-service=dynamic");
 
     argc = echttp_open (argc, argv);
+    housesensor_driver_initialize (argc, argv);
+    housesensor_stream_initialize (argc, argv);
     if (echttp_dynamic_port()) {
         static const char *path[] = {"sensor:/sensor"};
         houseportal_initialize (argc, argv);
@@ -113,7 +232,10 @@ int main (int argc, const char **argv) {
     echttp_route_uri ("/sensor/status", hs_sensor_status);
     echttp_route_uri ("/sensor/recent", hs_sensor_recent);
     echttp_route_uri ("/sensor/history", hs_sensor_history);
-    echttp_static_route ("/sensor/records", "/var/lib/house/sensor");
+    echttp_route_uri ("/sensor/query", hs_sensor_query);
+    echttp_route_uri ("/sensor/metrics", hs_sensor_metrics);
+    echttp_route_uri ("/sensor/stream", hs_sensor_stream);
+    echttp_route_match ("/sensor/records", hs_sensor_records);
     echttp_static_route ("/", "/usr/local/share/house/public");
     echttp_background (&hs_background);
     echttp_loop();
@@ -0,0 +1,601 @@
+/* housesensor - A simple home web server for measurements.
+ *
+ * Copyright 2019, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housesensor_archive.c - The daily archives of measurements.
+ *
+ * SYNOPSIS:
+ *
+ * void housesensor_archive_initialize (const char *log);
+ *
+ *    Set the name of the log file to archive. Must be called once.
+ *
+ * const char *housesensor_archive_directory (void);
+ *
+ *    Return the name of the directory where the archives are stored.
+ *
+ * int housesensor_archive_exists (const struct tm *t);
+ *
+ *    Return 1 if the archive for the specified day exists, in any format.
+ *
+ * void housesensor_archive_save (const struct tm *t);
+ *
+ *    Copy the log to the archive for the specified day. Only the data
+ *    added to the log since the previous save is copied, unless the
+ *    archive does not match what was saved before.
+ *
+ * void housesensor_archive_move (const struct tm *t);
+ *
+ *    Move the log to the archive for the specified day. The log file
+ *    must have been closed. A CSV archive is indexed once completed.
+ *
+ * int housesensor_archive_count (void);
+ * const char *housesensor_archive_day (int index);
+ * int housesensor_archive_search (const char *day);
+ *
+ *    Access the list of the days for which an archive exists, in any
+ *    format, sorted by date. A day is represented by its name in the
+ *    YYYY-MM-DD format. The search function returns the index of the
+ *    first day that is the same as, or later than, the specified day.
+ *    The list is loaded once and then kept up to date as the archives
+ *    are created or removed, by this program or any other.
+ *
+ * const char *housesensor_archive_records (const char *name);
+ *
+ *    Return the content of the specified archive, for the HTTP server.
+ *    A CSV archive that was converted to the binary format is rebuilt
+ *    from the binary file, into a temporary file that is then sent.
+ *
+ * void housesensor_archive_metrics (void);
+ *
+ *    Report the duration of the saves and moves, and the volume of data
+ *    saved (see housesensor_metrics.c).
+ *
+ * The archives are copied and moved without running external commands:
+ * a move is a rename when the log and the archives are on the same file
+ * system, and a copy of the data not yet saved otherwise.
+ *
+ * The option archive.format selects the format of the daily archives
+ * when they are completed at midnight: "csv" (default) keeps the CSV
+ * file as is, "binary" converts it to the binary format and removes the
+ * CSV file if it converts back exactly, "both" converts it but keeps the
+ * CSV file.
+ */
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/inotify.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+
+#include "echttp_libc.h"
+
+#include "housesensor.h"
+#include "housesensor_db.h"
+#include "housesensor_binary.h"
+#include "housesensor_index.h"
+#include "housesensor_metrics.h"
+#include "housesensor_archive.h"
+
+
+static const char *ArchiveDirectory = "/var/lib/house/sensor";
+static const char ArchiveFormat[] = "%s/%04d-%02d-%02d.csv";
+
+static const char *ArchiveLog = 0;
+
+#define ARCHIVE_CSV    1
+#define ARCHIVE_BINARY 2
+static int ArchiveFormats = ARCHIVE_CSV;
+
+// What was saved last: the same archive will be appended to next time.
+//
+static char  ArchiveSavedName[256];
+static off_t ArchiveSavedSize = -1;
+
+static housesensor_histogram ArchiveSaveDuration;
+static housesensor_histogram ArchiveMoveDuration;
+static long long ArchiveSavedBytes = 0;
+
+// The sorted list of archived days. The directory is watched so that
+// the list does not need to be reloaded. If the directory cannot be
+// watched, the list is reloaded whenever the directory changes.
+//
+typedef struct {
+    char name[12]; // YYYY-MM-DD
+} ArchiveDay;
+
+static ArchiveDay *ArchiveDays = 0;
+static int ArchiveDayCount = 0;
+static int ArchiveDaySize = 0;
+
+static int    ArchiveWatch = -1;
+static time_t ArchiveDirectoryChanged = 0;
+
+static void ArchiveDayRefresh (const char *day);
+static void ArchiveDayLoad (void);
+
+
+void housesensor_archive_initialize (const char *log) {
+
+    const char *format = housesensor_db_option ("archive.format");
+    const char *directory = housesensor_db_option ("archive.directory");
+
+    ArchiveLog = log;
+    if (directory) ArchiveDirectory = directory;
+
+    ArchiveWatch = inotify_init1 (IN_NONBLOCK|IN_CLOEXEC);
+    if (ArchiveWatch >= 0) {
+        if (inotify_add_watch (ArchiveWatch, ArchiveDirectory,
+                               IN_CREATE|IN_DELETE|IN_MOVED_FROM|IN_MOVED_TO) < 0) {
+            close (ArchiveWatch);
+            ArchiveWatch = -1;
+        }
+    }
+    ArchiveDayLoad ();
+
+    if (format) {
+        if (!strcmp (format, "binary")) ArchiveFormats = ARCHIVE_BINARY;
+        else if (!strcmp (format, "both"))
+            ArchiveFormats = ARCHIVE_CSV|ARCHIVE_BINARY;
+        else if (strcmp (format, "csv"))
+            fprintf (stderr, "Invalid archive format %s\n", format);
+    }
+}
+
+const char *housesensor_archive_directory (void) {
+    return ArchiveDirectory;
+}
+
+static void ArchiveName (char *name, int size, const struct tm *t) {
+    snprintf (name, size, ArchiveFormat,
+              ArchiveDirectory, t->tm_year+1900, t->tm_mon+1, t->tm_mday);
+}
+
+int housesensor_archive_exists (const struct tm *t) {
+
+    char name[256];
+    struct stat info;
+
+    ArchiveName (name, sizeof(name), t);
+    if (stat (name, &info) == 0) return 1;
+
+    strcpy (name + strlen(name) - 4, ".hsb");
+    return stat (name, &info) == 0;
+}
+
+// Copy a range of the log to the same offset in the archive. The data
+// does not go through user space, unless none of the kernel methods is
+// supported for these files.
+//
+static int ArchiveCopy (int from, int to, off_t offset, off_t end) {
+
+    off_t in = offset;
+    off_t out = offset;
+    char buffer[16384];
+
+    while (in < end) {
+        ssize_t length = copy_file_range (from, &in, to, &out, end - in, 0);
+        if (length > 0) continue;
+        if (length == 0) return 0; // The log was truncated in between?
+        if (errno == EINTR) continue;
+        break; // Not supported for these files: try something else.
+    }
+    if (in >= end) return 1;
+
+    if (lseek (to, out, SEEK_SET) != out) return 0;
+    while (in < end) {
+        ssize_t length = sendfile (to, from, &in, end - in);
+        if (length > 0) continue;
+        if (length == 0) return 0;
+        if (errno == EINTR) continue;
+        break;
+    }
+    if (in >= end) return 1;
+
+    while (in < end) {
+        ssize_t length = pread (from, buffer, sizeof(buffer), in);
+        if (length <= 0) return 0;
+        if (write (to, buffer, length) != length) return 0;
+        in += length;
+    }
+    return 1;
+}
+
+static void ArchiveSave (const struct tm *t) {
+
+    char name[256];
+    struct stat info;
+    off_t start = 0;
+    int from;
+    int to;
+
+    if (!ArchiveLog) return;
+
+    from = open (ArchiveLog, O_RDONLY);
+    if (from < 0) return;
+    if (fstat (from, &info) < 0) {
+        close (from);
+        return;
+    }
+
+    ArchiveName (name, sizeof(name), t);
+    to = open (name, O_WRONLY|O_CREAT, 0644);
+    if (to < 0) {
+        if (echttp_isdebug())
+            printf ("Cannot open %s: %s\n", name, strerror(errno));
+        close (from);
+        return;
+    }
+
+    // Append only if the archive is exactly what was saved last time,
+    // else rewrite it all.
+    //
+    if (ArchiveSavedSize >= 0 && ArchiveSavedSize <= info.st_size &&
+        strcmp (name, ArchiveSavedName) == 0) {
+        struct stat archive;
+        if (fstat (to, &archive) == 0 && archive.st_size == ArchiveSavedSize)
+            start = ArchiveSavedSize;
+    }
+    if (start == 0) ftruncate (to, 0);
+
+    if (echttp_isdebug())
+        printf ("Saving %s to %s from offset %lld to %lld\n",
+                ArchiveLog, name, (long long)start, (long long)info.st_size);
+
+    if (ArchiveCopy (from, to, start, info.st_size)) {
+        strtcpy (ArchiveSavedName, name, sizeof(ArchiveSavedName));
+        ArchiveSavedSize = info.st_size;
+        ArchiveSavedBytes += info.st_size - start;
+    } else {
+        ArchiveSavedSize = -1;
+    }
+    close (to);
+    close (from);
+}
+
+void housesensor_archive_save (const struct tm *t) {
+
+    long long start = housesensor_metrics_now ();
+
+    ArchiveSave (t);
+    housesensor_metrics_observe (&ArchiveSaveDuration,
+                                 housesensor_metrics_now () - start);
+}
+
+static void ArchiveMove (const struct tm *t) {
+
+    char name[256];
+
+    if (!ArchiveLog) return;
+
+    ArchiveName (name, sizeof(name), t);
+    if (echttp_isdebug()) printf ("Moving %s to %s\n", ArchiveLog, name);
+
+    if (rename (ArchiveLog, name) < 0) {
+        if (errno != EXDEV) {
+            if (echttp_isdebug())
+                printf ("Cannot move %s: %s\n", ArchiveLog, strerror(errno));
+            return;
+        }
+        // Not on the same file system: complete the previous saves,
+        // then remove the log.
+        //
+        housesensor_archive_save (t);
+        if (ArchiveSavedSize < 0) return; // Keep the log: nothing is lost.
+        unlink (ArchiveLog);
+    }
+    ArchiveSavedSize = -1;
+    ArchiveDayRefresh (name + strlen(ArchiveDirectory) + 1);
+
+    if (ArchiveFormats & ARCHIVE_CSV) {
+        if (!housesensor_index_write (name))
+            fprintf (stderr, "Cannot index %s\n", name);
+    }
+
+    if (ArchiveFormats & ARCHIVE_BINARY) {
+        char binary[256];
+        int length = strlen(name) - 4; // Remove ".csv".
+        snprintf (binary, sizeof(binary), "%*.*s.hsb", length, length, name);
+        if (echttp_isdebug()) printf ("Converting %s to %s\n", name, binary);
+        if (!housesensor_binary_write (name, binary)) {
+            fprintf (stderr, "Cannot convert %s\n", name);
+            return; // Keep the CSV file: nothing is lost.
+        }
+        if (ArchiveFormats & ARCHIVE_CSV) return;
+
+        // Only remove the CSV file if it can be rebuilt from the binary
+        // file exactly: lines that are not valid measurements are not
+        // preserved by the conversion.
+        //
+        if (!housesensor_binary_verify (name, binary)) {
+            fprintf (stderr, "%s does not convert back exactly, kept\n", name);
+            return;
+        }
+        unlink (name);
+    }
+}
+
+void housesensor_archive_move (const struct tm *t) {
+
+    long long start = housesensor_metrics_now ();
+
+    ArchiveMove (t);
+    housesensor_metrics_observe (&ArchiveMoveDuration,
+                                 housesensor_metrics_now () - start);
+}
+
+// Return the day for an archive file name, or 0 if the name is not
+// the name of an archive (YYYY-MM-DD.csv or YYYY-MM-DD.hsb).
+//
+static const char *ArchiveDayOf (const char *name, char *day) {
+
+    static const char pattern[] = "dddd-dd-dd.";
+    int i;
+
+    for (i = 0; pattern[i]; ++i) {
+        if (pattern[i] == 'd') {
+            if (name[i] < '0' || name[i] > '9') return 0;
+        } else if (name[i] != pattern[i]) {
+            return 0;
+        }
+    }
+    if (strcmp (name + i, "csv") && strcmp (name + i, "hsb")) return 0;
+
+    memcpy (day, name, 10);
+    day[10] = 0;
+    return day;
+}
+
+static int ArchiveDayFind (const char *day, int *found) {
+
+    int low = 0;
+    int high = ArchiveDayCount;
+
+    while (low < high) {
+        int middle = (low + high) / 2;
+        int order = strcmp (ArchiveDays[middle].name, day);
+        if (order == 0) {
+            *found = 1;
+            return middle;
+        }
+        if (order < 0) low = middle + 1;
+        else high = middle;
+    }
+    *found = 0;
+    return low;
+}
+
+static void ArchiveDayInsert (const char *day) {
+
+    int found;
+    int index = ArchiveDayFind (day, &found);
+
+    if (found) return;
+
+    if (ArchiveDayCount >= ArchiveDaySize) {
+        ArchiveDaySize = ArchiveDaySize ? ArchiveDaySize * 2 : 1024;
+        ArchiveDays = realloc (ArchiveDays, ArchiveDaySize * sizeof(ArchiveDay));
+        if (!ArchiveDays) {
+            fprintf (stderr, "No enough memory for %d days\n", ArchiveDaySize);
+            exit (1);
+        }
+    }
+    memmove (ArchiveDays + index + 1, ArchiveDays + index,
+             (ArchiveDayCount - index) * sizeof(ArchiveDay));
+    strtcpy (ArchiveDays[index].name, day, sizeof(ArchiveDays[index].name));
+    ArchiveDayCount += 1;
+}
+
+static void ArchiveDayRemove (const char *day) {
+
+    int found;
+    int index = ArchiveDayFind (day, &found);
+
+    if (!found) return;
+
+    ArchiveDayCount -= 1;
+    memmove (ArchiveDays + index, ArchiveDays + index + 1,
+             (ArchiveDayCount - index) * sizeof(ArchiveDay));
+}
+
+// A day is listed as long as one of its archive files exists.
+//
+static void ArchiveDayRefresh (const char *name) {
+
+    static const char *extensions[] = {"csv", "hsb", 0};
+
+    char day[12];
+    char path[256];
+    struct stat info;
+    int i;
+
+    if (!ArchiveDayOf (name, day)) return;
+
+    for (i = 0; extensions[i]; ++i) {
+        snprintf (path, sizeof(path),
+                  "%s/%s.%s", ArchiveDirectory, day, extensions[i]);
+        if (stat (path, &info) == 0) {
+            ArchiveDayInsert (day);
+            return;
+        }
+    }
+    ArchiveDayRemove (day);
+}
+
+static void ArchiveDayLoad (void) {
+
+    char day[12];
+    struct stat info;
+    struct dirent *de;
+    DIR *d;
+
+    ArchiveDayCount = 0;
+
+    if (stat (ArchiveDirectory, &info) == 0)
+        ArchiveDirectoryChanged = info.st_mtime;
+
+    d = opendir (ArchiveDirectory);
+    if (!d) return;
+    while ((de = readdir(d))) {
+        if (ArchiveDayOf (de->d_name, day)) ArchiveDayInsert (day);
+    }
+    closedir (d);
+    if (echttp_isdebug())
+        printf ("Found %d archived days in %s\n",
+                ArchiveDayCount, ArchiveDirectory);
+}
+
+static void ArchiveDayUpdate (void) {
+
+    char buffer[4096]
+        __attribute__ ((aligned(__alignof__(struct inotify_event))));
+
+    if (ArchiveWatch < 0) {
+        struct stat info;
+        if (stat (ArchiveDirectory, &info) == 0 &&
+            info.st_mtime != ArchiveDirectoryChanged) ArchiveDayLoad ();
+        return;
+    }
+
+    for (;;) {
+        const struct inotify_event *event;
+        char *p;
+        ssize_t length = read (ArchiveWatch, buffer, sizeof(buffer));
+        if (length <= 0) break;
+
+        for (p = buffer; p < buffer + length;
+             p += sizeof(struct inotify_event) + event->len) {
+            event = (const struct inotify_event *)p;
+            if (event->mask & IN_Q_OVERFLOW) {
+                ArchiveDayLoad ();
+                continue;
+            }
+            if (event->len > 0) ArchiveDayRefresh (event->name);
+        }
+    }
+}
+
+int housesensor_archive_count (void) {
+    ArchiveDayUpdate ();
+    return ArchiveDayCount;
+}
+
+const char *housesensor_archive_day (int index) {
+    if (index < 0 || index >= ArchiveDayCount) return 0;
+    return ArchiveDays[index].name;
+}
+
+int housesensor_archive_search (const char *day) {
+
+    int found;
+
+    ArchiveDayUpdate ();
+    return ArchiveDayFind (day, &found);
+}
+
+// Rebuild a CSV archive from its binary version, into an anonymous
+// temporary file in the archive directory. Return the open file, or -1.
+//
+static int ArchiveConvert (const char *binary, off_t *size) {
+
+    char path[256];
+    int fd = open (ArchiveDirectory, O_TMPFILE|O_RDWR|O_CLOEXEC, 0600);
+
+    if (fd < 0) {
+        // Not all file systems support O_TMPFILE.
+        //
+        snprintf (path, sizeof(path), "%s/.convertXXXXXX", ArchiveDirectory);
+        fd = mkstemp (path);
+        if (fd < 0) return -1;
+        unlink (path);
+    }
+    if (!housesensor_binary_csv (binary, fd)) {
+        close (fd);
+        return -1;
+    }
+    *size = lseek (fd, 0, SEEK_CUR);
+    lseek (fd, 0, SEEK_SET);
+    return fd;
+}
+
+const char *housesensor_archive_records (const char *name) {
+
+    char path[256];
+    struct stat info;
+    off_t size;
+    int length;
+    int fd;
+
+    if (*name == '/') name += 1;
+    if (*name == 0 || strchr (name, '/') || strstr (name, "..")) {
+        echttp_error (404, "Not found");
+        return "";
+    }
+    snprintf (path, sizeof(path), "%s/%s", ArchiveDirectory, name);
+
+    fd = open (path, O_RDONLY);
+    if (fd >= 0) {
+        if (fstat (fd, &info) < 0 || !S_ISREG(info.st_mode)) {
+            close (fd);
+            echttp_error (404, "Not found");
+            return "";
+        }
+        length = strlen(name);
+        if (length > 4 && !strcmp (name + length - 4, ".csv"))
+            echttp_content_type_set ("text/csv");
+        echttp_transfer (fd, info.st_size);
+        return "";
+    }
+
+    // A CSV archive that only exists in the binary format.
+    //
+    length = strlen(path);
+    if (length > 4 && !strcmp (path + length - 4, ".csv")) {
+        strcpy (path + length - 4, ".hsb");
+        fd = ArchiveConvert (path, &size);
+        if (fd >= 0) {
+            echttp_content_type_set ("text/csv");
+            echttp_transfer (fd, size);
+            return "";
+        }
+    }
+    echttp_error (404, "Not found");
+    return "";
+}
+
+void housesensor_archive_metrics (void) {
+
+    housesensor_metrics_declare ("housesensor_archive_save_seconds",
+                                 "histogram",
+                                 "Time to save the log to the archive.");
+    housesensor_metrics_histogram (0, 0, &ArchiveSaveDuration);
+
+    housesensor_metrics_declare ("housesensor_archive_move_seconds",
+                                 "histogram",
+                                 "Time to move and convert a daily archive.");
+    housesensor_metrics_histogram (0, 0, &ArchiveMoveDuration);
+
+    housesensor_metrics_declare ("housesensor_archive_saved_bytes_total",
+                                 "counter",
+                                 "Bytes copied from the log to the archive.");
+    housesensor_metrics_value (0, 0, ArchiveSavedBytes);
+}
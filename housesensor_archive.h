@@ -0,0 +1,38 @@
+/* housesensor - A simple home web server for measurements.
+ *
+ * Copyright 2019, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housesensor_archive.h - The daily archives of measurements.
+ */
+void housesensor_archive_initialize (const char *log);
+
+const char *housesensor_archive_directory (void);
+int  housesensor_archive_exists (const struct tm *t);
+
+void housesensor_archive_save (const struct tm *t);
+void housesensor_archive_move (const struct tm *t);
+
+int housesensor_archive_count (void);
+const char *housesensor_archive_day (int index);
+int housesensor_archive_search (const char *day);
+
+const char *housesensor_archive_records (const char *name);
+
+void housesensor_archive_metrics (void);
+
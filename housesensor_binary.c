@@ -0,0 +1,799 @@
+/* housesensor - A simple home web server for measurements.
+ *
+ * Copyright 2019, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housesensor_binary.c - The binary (columnar) archive format.
+ *
+ * SYNOPSIS:
+ *
+ * int housesensor_binary_write (const char *csv, const char *binary);
+ *
+ *    Convert a daily CSV archive into the binary format. Return 1 on
+ *    success, 0 on failure.
+ *
+ * int housesensor_binary_read (const char *binary,
+ *                              housesensor_binary_listener *listener,
+ *                              void *context);
+ *
+ *    Decode a binary archive and call the listener for each measurement.
+ *    The measurements are reported sensor by sensor, in time order for
+ *    each sensor. The numeric values are in thousandths; text is null
+ *    unless the value is not numeric. Return 0 if the file is not valid.
+ *
+ * int housesensor_binary_csv (const char *binary, int fd);
+ *
+ *    Convert a binary archive back to the CSV format, written to the
+ *    specified file. The conversion is streamed: the memory used does
+ *    not depend on the size of the archive. Return 0 on failure.
+ *
+ * int housesensor_binary_verify (const char *csv, const char *binary);
+ *
+ *    Return 1 if the binary archive converts back to the exact content
+ *    of the CSV file. The conversion does not preserve lines that are
+ *    not valid measurements, or line terminators other than a newline:
+ *    the CSV file must not be removed unless this check passed.
+ *
+ * FORMAT:
+ *
+ * The file starts with the magic "HSB1" and the number of sensors,
+ * followed by one header per sensor: location, name, unit, type (0 for
+ * numeric, 1 for text), count of measurements, and the size in bytes of
+ * its order, timestamp and value columns. The columns follow the headers,
+ * in the same order as the sensors.
+ *
+ * All integers are variable-length (7 bits per byte, little endian).
+ * Signed integers are zigzag-encoded. Strings are a length followed by
+ * the characters. Each timestamp is the difference from the previous one
+ * (the first one is absolute). Each numeric value is the difference from
+ * the previous value of the same sensor, in thousandths. Text values are
+ * stored as strings. The order column holds the difference between the
+ * line numbers of consecutive measurements of the same sensor in the CSV
+ * file, so that the measurements can be listed in their original order.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+
+#include "housesensor.h"
+#include "housesensor_db.h"
+#include "housesensor_binary.h"
+
+
+static const char BinaryMagic[4] = "HSB1";
+
+typedef struct {
+    unsigned char *data;
+    int length;
+    int size;
+} BinaryBuffer;
+
+typedef struct {
+    char *location;
+    char *name;
+    char *unit;
+    int istext;
+    int count;
+    long long order;   // The previous one.
+    time_t timestamp;  // The previous one.
+    long long value;   // The previous one.
+    BinaryBuffer orders;
+    BinaryBuffer times;
+    BinaryBuffer values;
+} BinarySensor;
+
+static void BufferAppend (BinaryBuffer *b, const void *data, int length) {
+
+    if (b->length + length > b->size) {
+        b->size = b->length + length + 1024;
+        b->data = realloc (b->data, b->size);
+        if (!b->data) {
+            fprintf (stderr, "No enough memory for %d bytes\n", b->size);
+            exit (1);
+        }
+    }
+    memcpy (b->data + b->length, data, length);
+    b->length += length;
+}
+
+static void BufferUnsigned (BinaryBuffer *b, unsigned long long value) {
+
+    unsigned char bytes[10];
+    int length = 0;
+
+    do {
+        bytes[length] = value & 0x7f;
+        value >>= 7;
+        if (value) bytes[length] |= 0x80;
+        length += 1;
+    } while (value);
+    BufferAppend (b, bytes, length);
+}
+
+static void BufferSigned (BinaryBuffer *b, long long value) {
+    BufferUnsigned (b, ((unsigned long long)value << 1) ^ (value >> 63));
+}
+
+static void BufferString (BinaryBuffer *b, const char *text) {
+    int length = strlen(text);
+    BufferUnsigned (b, length);
+    BufferAppend (b, text, length);
+}
+
+// A small hash table of the sensors found in the CSV file, keyed
+// on location, name and unit.
+//
+static BinarySensor *BinarySensors = 0;
+static int BinarySensorCount = 0;
+static int *BinaryHash = 0;
+static int BinaryHashSize = 0;
+
+static unsigned int BinaryKey (const char *location,
+                               const char *name, const char *unit) {
+
+    unsigned int hash = 2166136261u; // FNV-1a.
+
+    while (*location) hash = (hash ^ (unsigned char)(*location++)) * 16777619u;
+    hash = (hash ^ ',') * 16777619u;
+    while (*name) hash = (hash ^ (unsigned char)(*name++)) * 16777619u;
+    hash = (hash ^ ',') * 16777619u;
+    while (*unit) hash = (hash ^ (unsigned char)(*unit++)) * 16777619u;
+    return hash;
+}
+
+static void BinaryRehash (void) {
+
+    int i;
+
+    BinaryHashSize = BinaryHashSize ? BinaryHashSize * 2 : 256;
+    BinaryHash = realloc (BinaryHash, BinaryHashSize * sizeof(int));
+    if (!BinaryHash) {
+        fprintf (stderr, "No enough memory for %d sensors\n", BinaryHashSize);
+        exit (1);
+    }
+    for (i = 0; i < BinaryHashSize; ++i) BinaryHash[i] = -1;
+    for (i = 0; i < BinarySensorCount; ++i) {
+        BinarySensor *s = BinarySensors + i;
+        unsigned int slot = BinaryKey (s->location, s->name, s->unit);
+        slot &= BinaryHashSize - 1;
+        while (BinaryHash[slot] >= 0) slot = (slot + 1) & (BinaryHashSize - 1);
+        BinaryHash[slot] = i;
+    }
+}
+
+static BinarySensor *BinaryFind (const char *location,
+                                 const char *name, const char *unit) {
+
+    unsigned int slot;
+    BinarySensor *s;
+
+    if (2 * (BinarySensorCount + 1) > BinaryHashSize) BinaryRehash ();
+
+    slot = BinaryKey (location, name, unit) & (BinaryHashSize - 1);
+    while (BinaryHash[slot] >= 0) {
+        s = BinarySensors + BinaryHash[slot];
+        if (!strcmp (s->name, name) &&
+            !strcmp (s->location, location) && !strcmp (s->unit, unit))
+            return s;
+        slot = (slot + 1) & (BinaryHashSize - 1);
+    }
+
+    BinarySensors =
+        realloc (BinarySensors, sizeof(BinarySensor) * (BinarySensorCount+1));
+    if (!BinarySensors) {
+        fprintf (stderr, "No enough memory for %d sensors\n",
+                 BinarySensorCount+1);
+        exit (1);
+    }
+    BinaryHash[slot] = BinarySensorCount;
+    s = BinarySensors + BinarySensorCount++;
+    memset (s, 0, sizeof(BinarySensor));
+    s->location = strdup (location);
+    s->name = strdup (name);
+    s->unit = strdup (unit);
+    return s;
+}
+
+static void BinaryReset (void) {
+
+    int i;
+
+    for (i = 0; i < BinarySensorCount; ++i) {
+        BinarySensor *s = BinarySensors + i;
+        free (s->location);
+        free (s->name);
+        free (s->unit);
+        free (s->orders.data);
+        free (s->times.data);
+        free (s->values.data);
+    }
+    free (BinarySensors);
+    free (BinaryHash);
+    BinarySensors = 0;
+    BinarySensorCount = 0;
+    BinaryHash = 0;
+    BinaryHashSize = 0;
+}
+
+// A value is stored as a number only if it is formatted back to the
+// exact same text, so that the CSV line can be rebuilt identically.
+//
+static int BinaryNumeric (const char *text, long long *value) {
+
+    char buffer[24];
+
+    if (!housesensor_db_parse (text, value)) return 0;
+    return strcmp (housesensor_db_format (buffer, *value), text) == 0;
+}
+
+// Once a sensor has a non-numeric value, all its values are stored as
+// text: the numeric values already encoded are converted back.
+//
+static void BinaryToText (BinarySensor *s) {
+
+    BinaryBuffer values = {0, 0, 0};
+    unsigned char *p = s->values.data;
+    unsigned char *end = p + s->values.length;
+    long long value = 0;
+    char buffer[24];
+
+    while (p < end) {
+        unsigned long long zigzag = 0;
+        int shift = 0;
+        do {
+            zigzag |= (unsigned long long)(*p & 0x7f) << shift;
+            shift += 7;
+        } while (*(p++) & 0x80);
+        value += (long long)(zigzag >> 1) ^ -(long long)(zigzag & 1);
+        BufferString (&values, housesensor_db_format (buffer, value));
+    }
+    free (s->values.data);
+    s->values = values;
+    s->istext = 1;
+}
+
+static void BinaryAdd (long long order, time_t timestamp,
+                       const char *location, const char *name,
+                       const char *value, const char *unit) {
+
+    BinarySensor *s = BinaryFind (location, name, unit);
+    long long number;
+
+    BufferUnsigned (&(s->orders), (unsigned long long)(order - s->order));
+    s->order = order;
+
+    BufferSigned (&(s->times), (long long)(timestamp - s->timestamp));
+    s->timestamp = timestamp;
+
+    if (!s->istext) {
+        if (BinaryNumeric (value, &number)) {
+            BufferSigned (&(s->values), number - s->value);
+            s->value = number;
+        } else {
+            BinaryToText (s);
+        }
+    }
+    if (s->istext) BufferString (&(s->values), value);
+    s->count += 1;
+}
+
+static int BinaryDecodeLine (long long order, char *line) {
+
+    char *field[5];
+    int count = 1;
+    char *p;
+
+    field[0] = line;
+    for (p = line; *p; ++p) {
+        if (*p == '\n' || *p == '\r') {
+            *p = 0;
+            break;
+        }
+        if (*p == ',' && count < 5) {
+            *p = 0;
+            field[count++] = p + 1;
+        }
+    }
+    if (count < 4) return 0;
+    if (count < 5) field[4] = "";
+
+    BinaryAdd (order,
+               (time_t)atoll(field[0]), field[1], field[2], field[3], field[4]);
+    return 1;
+}
+
+int housesensor_binary_write (const char *csv, const char *binary) {
+
+    char *line = 0;
+    size_t size = 0;
+    char temporary[1024];
+    BinaryBuffer header = {0, 0, 0};
+    FILE *in;
+    FILE *out;
+    long long order = 0;
+    int ok = 1;
+    int i;
+
+    in = fopen (csv, "r");
+    if (!in) return 0;
+    while (getline (&line, &size, in) >= 0) {
+        if (BinaryDecodeLine (order+1, line)) order += 1;
+    }
+    free (line);
+    fclose (in);
+
+    BufferAppend (&header, BinaryMagic, sizeof(BinaryMagic));
+    BufferUnsigned (&header, BinarySensorCount);
+    for (i = 0; i < BinarySensorCount; ++i) {
+        BinarySensor *s = BinarySensors + i;
+        BufferString (&header, s->location);
+        BufferString (&header, s->name);
+        BufferString (&header, s->unit);
+        BufferUnsigned (&header, s->istext);
+        BufferUnsigned (&header, s->count);
+        BufferUnsigned (&header, s->orders.length);
+        BufferUnsigned (&header, s->times.length);
+        BufferUnsigned (&header, s->values.length);
+    }
+
+    snprintf (temporary, sizeof(temporary), "%s.tmp", binary);
+    out = fopen (temporary, "w");
+    if (out) {
+        if (fwrite (header.data, header.length, 1, out) != 1) ok = 0;
+        for (i = 0; i < BinarySensorCount && ok; ++i) {
+            BinarySensor *s = BinarySensors + i;
+            if (s->orders.length &&
+                fwrite (s->orders.data, s->orders.length, 1, out) != 1) ok = 0;
+            if (s->times.length &&
+                fwrite (s->times.data, s->times.length, 1, out) != 1) ok = 0;
+            if (s->values.length &&
+                fwrite (s->values.data, s->values.length, 1, out) != 1) ok = 0;
+        }
+        if (fclose (out)) ok = 0;
+        if (ok) ok = (rename (temporary, binary) == 0);
+        if (!ok) unlink (temporary);
+    } else {
+        ok = 0;
+    }
+    free (header.data);
+    BinaryReset ();
+    return ok;
+}
+
+typedef struct {
+    const unsigned char *p;
+    const unsigned char *end;
+} BinaryCursor;
+
+// A string in the binary data. It is not null terminated.
+//
+typedef struct {
+    const unsigned char *p;
+    int length;
+} BinarySpan;
+
+static int CursorUnsigned (BinaryCursor *c, unsigned long long *value) {
+
+    int shift = 0;
+
+    *value = 0;
+    while (c->p < c->end && shift < 64) {
+        unsigned char byte = *(c->p++);
+        *value |= (unsigned long long)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) return 1;
+        shift += 7;
+    }
+    return 0;
+}
+
+static int CursorSigned (BinaryCursor *c, long long *value) {
+
+    unsigned long long zigzag;
+
+    if (!CursorUnsigned (c, &zigzag)) return 0;
+    *value = (long long)(zigzag >> 1) ^ -(long long)(zigzag & 1);
+    return 1;
+}
+
+static int CursorSpan (BinaryCursor *c, BinarySpan *span) {
+
+    unsigned long long length;
+
+    if (!CursorUnsigned (c, &length)) return 0;
+    if (length > c->end - c->p) return 0;
+    span->p = c->p;
+    span->length = (int)length;
+    c->p += length;
+    return 1;
+}
+
+static int SpanCopy (const BinarySpan *span, char *buffer, int size) {
+
+    if (span->length >= size) return 0;
+    memcpy (buffer, span->p, span->length);
+    buffer[span->length] = 0;
+    return 1;
+}
+
+// The columns of one sensor, decoded one measurement at a time. The
+// order, timestamp and value (or text) are those of the measurement
+// decoded last.
+//
+typedef struct {
+    BinarySpan location;
+    BinarySpan name;
+    BinarySpan unit;
+    int istext;
+    unsigned long long remaining;
+    unsigned long long sizes[3]; // Of the order, time and value columns.
+    BinaryCursor orders;
+    BinaryCursor times;
+    BinaryCursor values;
+    unsigned long long order;
+    time_t timestamp;
+    long long value;
+    BinarySpan text;
+} BinaryStream;
+
+// Decode the headers and locate the columns of each sensor. Return 0
+// if the file is not valid.
+//
+static BinaryStream *BinaryOpen (const unsigned char *data, int size,
+                                 int *count) {
+
+    BinaryCursor header;
+    BinaryStream *streams;
+    unsigned long long sensors;
+    unsigned long long i;
+    const unsigned char *column;
+
+    if (size < sizeof(BinaryMagic)) return 0;
+    if (memcmp (data, BinaryMagic, sizeof(BinaryMagic))) return 0;
+
+    header.p = data + sizeof(BinaryMagic);
+    header.end = data + size;
+    if (!CursorUnsigned (&header, &sensors)) return 0;
+    if (sensors > size) return 0; // Each header takes several bytes.
+
+    streams = calloc (sensors + 1, sizeof(BinaryStream));
+    if (!streams) {
+        fprintf (stderr, "No enough memory for %lld sensors\n", sensors);
+        exit (1);
+    }
+
+    for (i = 0; i < sensors; ++i) {
+        BinaryStream *s = streams + i;
+        unsigned long long istext;
+        if (!CursorSpan (&header, &(s->location))) goto invalid;
+        if (!CursorSpan (&header, &(s->name))) goto invalid;
+        if (!CursorSpan (&header, &(s->unit))) goto invalid;
+        if (!CursorUnsigned (&header, &istext)) goto invalid;
+        if (!CursorUnsigned (&header, &(s->remaining))) goto invalid;
+        if (!CursorUnsigned (&header, s->sizes)) goto invalid;
+        if (!CursorUnsigned (&header, s->sizes+1)) goto invalid;
+        if (!CursorUnsigned (&header, s->sizes+2)) goto invalid;
+        s->istext = (istext != 0);
+    }
+
+    // The columns start right after the last header.
+    //
+    column = header.p;
+    for (i = 0; i < sensors; ++i) {
+        BinaryStream *s = streams + i;
+        if (s->sizes[0] > header.end - column) goto invalid;
+        s->orders.p = column;
+        s->orders.end = column += s->sizes[0];
+        if (s->sizes[1] > header.end - column) goto invalid;
+        s->times.p = column;
+        s->times.end = column += s->sizes[1];
+        if (s->sizes[2] > header.end - column) goto invalid;
+        s->values.p = column;
+        s->values.end = column += s->sizes[2];
+    }
+    *count = (int)sensors;
+    return streams;
+
+invalid:
+    free (streams);
+    return 0;
+}
+
+// Decode the next measurement of a sensor. Return 0 if there is none:
+// this is an error if the count of measurements was not reached.
+//
+static int BinaryNext (BinaryStream *s) {
+
+    unsigned long long step;
+    long long delta;
+
+    if (s->remaining == 0) return 0;
+    if (!CursorUnsigned (&(s->orders), &step)) return 0;
+    if (!CursorSigned (&(s->times), &delta)) return 0;
+    if (s->istext) {
+        if (!CursorSpan (&(s->values), &(s->text))) return 0;
+    } else {
+        long long value;
+        if (!CursorSigned (&(s->values), &value)) return 0;
+        s->value += value;
+    }
+    s->order += step;
+    s->timestamp += delta;
+    s->remaining -= 1;
+    return 1;
+}
+
+static int BinaryDecode (const unsigned char *data, int size,
+                         housesensor_binary_listener *listener,
+                         void *context) {
+
+    BinaryStream *streams;
+    int count;
+    int ok = 1;
+    int i;
+
+    streams = BinaryOpen (data, size, &count);
+    if (!streams) return 0;
+
+    for (i = 0; i < count && ok; ++i) {
+        BinaryStream *s = streams + i;
+        char location[1024];
+        char name[1024];
+        char unit[1024];
+        char text[1024];
+
+        if (!SpanCopy (&(s->location), location, sizeof(location)) ||
+            !SpanCopy (&(s->name), name, sizeof(name)) ||
+            !SpanCopy (&(s->unit), unit, sizeof(unit))) {
+            ok = 0;
+            break;
+        }
+        while (BinaryNext (s)) {
+            if (s->istext) {
+                if (!SpanCopy (&(s->text), text, sizeof(text))) {
+                    ok = 0;
+                    break;
+                }
+                listener (context,
+                          location, name, unit, s->timestamp, 0, text);
+            } else {
+                listener (context,
+                          location, name, unit, s->timestamp, s->value, 0);
+            }
+        }
+        if (s->remaining) ok = 0;
+    }
+    free (streams);
+    return ok;
+}
+
+static void *BinaryMap (const char *binary, int *size) {
+
+    struct stat info;
+    void *data;
+    int fd = open (binary, O_RDONLY);
+
+    if (fd < 0) return 0;
+    if (fstat (fd, &info) < 0 || info.st_size <= 0 ||
+        info.st_size > 0x7fffffff) {
+        close (fd);
+        return 0;
+    }
+    data = mmap (0, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close (fd);
+    if (data == MAP_FAILED) return 0;
+    *size = (int)info.st_size;
+    return data;
+}
+
+int housesensor_binary_read (const char *binary,
+                             housesensor_binary_listener *listener,
+                             void *context) {
+
+    int size;
+    int ok;
+    void *data = BinaryMap (binary, &size);
+
+    if (!data) return 0;
+    ok = BinaryDecode (data, size, listener, context);
+    munmap (data, size);
+    return ok;
+}
+
+// To rebuild the CSV file, the columns of all sensors are merged back
+// in their original order: a heap holds the sensors, ordered by the
+// order of their current measurement. Only one measurement per sensor
+// is decoded at a time, and the lines are passed to a sink in blocks,
+// so that the memory used does not depend on the size of the file.
+//
+typedef int BinarySink (void *context, const char *data, int length);
+
+#define BINARY_BLOCK 65536
+
+static int BinaryBefore (BinaryStream *streams, int a, int b) {
+    return streams[a].order < streams[b].order;
+}
+
+static void BinaryHeapDown (BinaryStream *streams, int *heap, int count) {
+
+    int i = 0;
+
+    for (;;) {
+        int smallest = i;
+        int left = (2 * i) + 1;
+        int right = left + 1;
+        int swap;
+        if (left < count && BinaryBefore (streams, heap[left], heap[smallest]))
+            smallest = left;
+        if (right < count &&
+            BinaryBefore (streams, heap[right], heap[smallest]))
+            smallest = right;
+        if (smallest == i) return;
+        swap = heap[i];
+        heap[i] = heap[smallest];
+        heap[smallest] = swap;
+        i = smallest;
+    }
+}
+
+static void BinaryHeapUp (BinaryStream *streams, int *heap, int i) {
+
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        int swap;
+        if (!BinaryBefore (streams, heap[i], heap[parent])) return;
+        swap = heap[i];
+        heap[i] = heap[parent];
+        heap[parent] = swap;
+        i = parent;
+    }
+}
+
+static void BinaryCsvLine (BinaryBuffer *out, const BinaryStream *s) {
+
+    char buffer[48];
+    char number[24];
+    int length;
+
+    length = snprintf (buffer, sizeof(buffer),
+                       "%lld,", (long long)s->timestamp);
+    BufferAppend (out, buffer, length);
+    BufferAppend (out, s->location.p, s->location.length);
+    BufferAppend (out, ",", 1);
+    BufferAppend (out, s->name.p, s->name.length);
+    BufferAppend (out, ",", 1);
+    if (s->istext) {
+        BufferAppend (out, s->text.p, s->text.length);
+    } else {
+        const char *value = housesensor_db_format (number, s->value);
+        BufferAppend (out, value, strlen(value));
+    }
+    BufferAppend (out, ",", 1);
+    BufferAppend (out, s->unit.p, s->unit.length);
+    BufferAppend (out, "\n", 1);
+}
+
+static int BinaryMerge (const char *binary, BinarySink *sink, void *context) {
+
+    BinaryBuffer out = {0, 0, 0};
+    BinaryStream *streams;
+    int *heap;
+    int count;
+    int active = 0;
+    int size;
+    int ok = 1;
+    int i;
+    void *data = BinaryMap (binary, &size);
+
+    if (!data) return 0;
+    streams = BinaryOpen (data, size, &count);
+    if (!streams) {
+        munmap (data, size);
+        return 0;
+    }
+    heap = calloc (count + 1, sizeof(int));
+    if (!heap) {
+        fprintf (stderr, "No enough memory for %d sensors\n", count);
+        exit (1);
+    }
+
+    for (i = 0; i < count; ++i) {
+        if (BinaryNext (streams + i)) {
+            heap[active] = i;
+            BinaryHeapUp (streams, heap, active++);
+        } else if (streams[i].remaining) {
+            ok = 0;
+        }
+    }
+
+    while (active > 0 && ok) {
+        BinaryStream *s = streams + heap[0];
+
+        BinaryCsvLine (&out, s);
+        if (out.length >= BINARY_BLOCK) {
+            ok = sink (context, (const char *)out.data, out.length);
+            out.length = 0;
+        }
+        if (!BinaryNext (s)) {
+            if (s->remaining) ok = 0;
+            heap[0] = heap[--active];
+        }
+        BinaryHeapDown (streams, heap, active);
+    }
+    if (ok && out.length > 0)
+        ok = sink (context, (const char *)out.data, out.length);
+
+    free (out.data);
+    free (heap);
+    free (streams);
+    munmap (data, size);
+    return ok;
+}
+
+static int BinaryWriteSink (void *context, const char *data, int length) {
+
+    int fd = *((int *)context);
+
+    while (length > 0) {
+        int written = write (fd, data, length);
+        if (written <= 0) return 0;
+        data += written;
+        length -= written;
+    }
+    return 1;
+}
+
+int housesensor_binary_csv (const char *binary, int fd) {
+    return BinaryMerge (binary, BinaryWriteSink, &fd);
+}
+
+typedef struct {
+    FILE *csv;
+    BinaryBuffer buffer;
+} BinaryCompare;
+
+static int BinaryCompareSink (void *context, const char *data, int length) {
+
+    BinaryCompare *compare = (BinaryCompare *)context;
+
+    if (compare->buffer.size < length) {
+        compare->buffer.length = 0;
+        BufferAppend (&(compare->buffer), data, length);
+    }
+    if (fread (compare->buffer.data, 1, length, compare->csv) != length)
+        return 0;
+    return memcmp (compare->buffer.data, data, length) == 0;
+}
+
+int housesensor_binary_verify (const char *csv, const char *binary) {
+
+    BinaryCompare compare;
+    int ok;
+
+    compare.csv = fopen (csv, "r");
+    if (!compare.csv) return 0;
+    memset (&(compare.buffer), 0, sizeof(compare.buffer));
+
+    ok = BinaryMerge (binary, BinaryCompareSink, &compare);
+    if (ok && fgetc (compare.csv) != EOF) ok = 0; // The CSV is longer.
+
+    fclose (compare.csv);
+    free (compare.buffer.data);
+    return ok;
+}
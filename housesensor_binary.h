@@ -0,0 +1,39 @@
+/* housesensor - A simple home web server for measurements.
+ *
+ * Copyright 2019, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housesensor_binary.h - The binary (columnar) archive format.
+ */
+int housesensor_binary_write (const char *csv, const char *binary);
+
+typedef void housesensor_binary_listener (void *context,
+                                          const char *location,
+                                          const char *name,
+                                          const char *unit,
+                                          time_t timestamp,
+                                          long long value,
+                                          const char *text);
+
+int housesensor_binary_read (const char *binary,
+                             housesensor_binary_listener *listener,
+                             void *context);
+
+int housesensor_binary_csv (const char *binary, int fd);
+int housesensor_binary_verify (const char *csv, const char *binary);
+
@@ -26,11 +26,46 @@
  *
  *    Load the sensor database. Must be called once.
  *
+ *    The configuration file is watched, and reloaded when it changes.
+ *    Only the differences are applied: the sensors that did not change
+ *    keep their latest value and their recent measurements.
+ *
  * void housesensor_db_set (const char *driver, const char *device,
  *                          const char *value, const char *unit);
  *
  *    Set the value for a specific sensor.
  *
+ *    A sensor may have a recording policy: a new value that is within a
+ *    deadband of the last recorded value only updates the latest value
+ *    of the sensor. It is not written to the log and not added to the
+ *    recent measurements, unless the heartbeat interval has elapsed
+ *    since the last recorded value. (It is still accounted for in the
+ *    minute, hour and day summaries, so that these remain exact.)
+ *    Each recorded value is also pushed to the stream subscribers (see
+ *    housesensor_stream.c).
+ *
+ * int housesensor_db_handle (const char *driver, const char *device);
+ *
+ *    Return a handle for the specified sensor, or -1 if the sensor is
+ *    not in the database. The handle remains valid for the lifetime
+ *    of the program, but is ignored once the sensor has been removed
+ *    from the configuration, or changed.
+ *
+ * void housesensor_db_set_handle (int handle,
+ *                                 const char *value, const char *unit);
+ *
+ *    Set the value for the sensor identified by the handle. This is
+ *    meant for drivers that resolve their devices once at initialization.
+ *    A value that is a valid number is stored as a number.
+ *
+ * void housesensor_db_set_number (int handle,
+ *                                 long long value, int decimals,
+ *                                 const char *unit);
+ *
+ *    Set a numeric value for the sensor identified by the handle. The value
+ *    is an integer in units of 10^-decimals, e.g. 21062 with 3 decimals
+ *    means 21.062. Values are stored with a precision of 3 decimals.
+ *
  * const char *housesensor_db_device_first (const char *driver);
  * const char *housesensor_db_device_next (const char *driver);
  *
@@ -38,20 +73,64 @@
  *
  * const char *housesensor_db_option (const char *name);
  *
- *    Get the value for the specified option.
+ *    Get the value for the specified option. The value remains valid
+ *    for the lifetime of the program, even if the option is changed.
+ *
+ * long housesensor_db_generation (void);
+ *
+ *    Return a number that changes each time the configuration is
+ *    reloaded. The drivers use it to detect that they must resolve
+ *    their devices again.
+ *
+ * const char *housesensor_db_host (void);
+ *
+ *    Get the name of this host, as reported in all JSON responses.
+ *
+ * const char *housesensor_db_format (char *buffer, long long value);
+ * int housesensor_db_parse (const char *text, long long *value);
+ *
+ *    Convert between the text representation of a numeric value and its
+ *    stored representation (an integer in thousandths). The buffer must
+ *    be at least 24 characters long. The parse function only accepts
+ *    plain decimal numbers with no more than 3 significant decimals, so
+ *    that formatting the value gives back the same number: it returns 0
+ *    if the text is not such a number (the value is then kept as text).
  *
  * const char *housesensor_db_latest (void);
  *
  *    Get a complete list of latest measurements in JSON format.
+ *    The JSON fragment for each sensor is rendered when the sensor is set,
+ *    and the whole list is assembled only if a sensor changed since the
+ *    last call.
+ *
+ * const char *housesensor_db_latest_tag (void);
  *
- * const char *housesensor_db_recent (void);
+ *    Get an entity tag that identifies the current content of the list
+ *    of latest measurements. The tag changes every time a sensor is set.
+ *
+ * const char *housesensor_db_recent (long long since);
  *
  *    Get a list of the N most recent measurements in JSON format.
+ *    Each measurement is assigned a sequence number: only measurements
+ *    more recent than the since sequence number are returned. The response
+ *    includes the sequence number to use as since in the next call, and
+ *    the number of measurements lost if some of the measurements since
+ *    that sequence number are no longer in memory.
+ *
+ * const char *housesensor_db_history (const char *from, const char *to,
+ *                                     int limit);
+ *
+ *    Get a list of the days for which history is available, in date
+ *    order. (We do not return the whole history: that could be huge.)
+ *    Only the days between from and to (in the YYYY-MM-DD format) are
+ *    listed, if specified, and no more than limit days if limit is not
+ *    negative. If the list was truncated, the response includes the
+ *    next day, to use as from in the next call.
  *
- * const char *housesensor_db_history (void);
+ * void housesensor_db_metrics (void);
  *
- *    Get a list of the days for which history is available.
- *    (We do not return the whole history: that could be huge.)
+ *    Report the number of sensors and measurements, and the volume of
+ *    data written to the log (see housesensor_metrics.c).
  *
  * void housesensor_db_background (time_t now);
  *
@@ -60,7 +139,8 @@
  */
 
 #include <sys/types.h>
-#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
 
 #include "echttp_libc.h"
 
@@ -68,11 +148,19 @@
 
 #include "housesensor.h"
 #include "housesensor_db.h"
+#include "housesensor_journal.h"
+#include "housesensor_archive.h"
+#include "housesensor_query.h"
+#include "housesensor_rollup.h"
+#include "housesensor_output.h"
+#include "housesensor_metrics.h"
+#include "housesensor_stream.h"
 
 
 typedef struct {
     char *location;
     int   first;
+    int   last;
 } SensorLocation;
 
 typedef struct {
@@ -81,71 +169,502 @@ typedef struct {
     char *location;
     char *name;
     char unit[32];
-    char value[128]; // ASCII representation.
+    char fixed;      // The unit was set in the configuration.
+    char removed;    // No longer in the configuration.
+    long loaded;     // The configuration generation that last listed it.
+    long long value; // In thousandths of the unit, if numeric.
+    char *text;      // The value, if not numeric (0 if numeric).
     time_t timestamp;
+
+    // The recording policy, see SensorPolicyResolve().
+    //
+    char filtered;      // A deadband or heartbeat applies to this sensor.
+    long long deadband; // In thousandths of the unit.
+    long long relative; // In thousandths of a percent of the value.
+    int heartbeat;      // In seconds, 0 if none.
+    long long recorded; // The last value written to the log.
+    time_t logged;      // When the last value was written to the log.
+
     int   next;
+    housesensor_output json; // JSON fragment for housesensor_db_latest().
 } SensorContext;
 
 typedef struct {
     char *name;
-    char *value;
+    char *value;  // 0 if no longer in the configuration.
+    long loaded;  // The configuration generation that last listed it.
 } SensorOption;
 
+// The events are stored in a ring that is allocated once at initialization.
+// A numeric value is stored inline. A non numeric value is a copy owned
+// by the ring, freed when its slot is reused: these values are rare.
+//
 typedef struct {
-    SensorContext *sensor;
     time_t timestamp;
-    char *value;
+    int    sensor; // Index in SensorDatabase.
+    char   istext;
+    union {
+        long long number;
+        char *text;
+    } value;
 } SensorEvent;
 
+#define SENSOR_SCALE 1000 // All numeric values are stored in thousandths.
+
+#define SENSOR_HEARTBEAT 900 // Default with a deadband, in seconds.
+
 #define SENSOR_DATABASE_BLOCK 64
 static SensorContext *SensorDatabase = 0;
 static int SensorDatabaseSize = 0;
 static int SensorCount = 0;
 static int SensorDriverCursor = 0;
 
-static SensorLocation SensorLocationDatabase[SENSOR_DATABASE_BLOCK];
+// The sensors, locations and options are indexed by open addressing
+// hash tables of indexes into their respective tables. The size of
+// a hash table is a power of 2 and is kept at least twice the number
+// of entries.
+//
+typedef struct {
+    int *slot; // Index in the indexed table, or -1 if empty.
+    int  size;
+} SensorIndex;
+
+// The sensors are keyed on the (driver, device) pair.
+//
+static SensorIndex SensorHash;
+
+static SensorLocation *SensorLocationDatabase = 0;
 static int SensorLocationCount = 0;
+static int SensorLocationSize = 0;
+static SensorIndex SensorLocationHash;
 
-static SensorOption SensorOptionDatabase[128];
+static SensorOption *SensorOptionDatabase = 0;
 static int SensorOptionCount = 0;
-
-static const char SensorLogName[] = "/dev/shm/housesensor.csv";
-static FILE *SensorLog = 0;
-static time_t SensorLogLastWrite = 0;
+static int SensorOptionSize = 0;
+static SensorIndex SensorOptionHash;
+
+// The configuration is reloaded when the file changes. The sensors and
+// options are never deleted, only marked as removed, so that handles
+// and option values remain valid.
+//
+static const char *SensorConfigName = "/etc/house/sensor.config";
+static long SensorConfigGeneration = 0;
+static int SensorConfigWatch = -1;
+static time_t SensorConfigChanged = 0;
+
+static char SensorHost[256];
+
+// The list of latest measurements is cached, and reassembled only when
+// the generation changed. Room is reserved at the beginning of the buffer
+// for the header, which is formatted on each call (it contains the
+// current time) and placed right before the cached sensor list.
+//
+#define SENSOR_LATEST_HEADER 1024
+static housesensor_output SensorLatest;
+static long  SensorLatestGeneration = -1;
+static long  SensorGeneration = 0;
+static time_t SensorStartTime = 0;
+
+static const char *SensorLogName = "/dev/shm/housesensor.csv";
 static time_t SensorLogLastMove = 0;
-static const char SensorArchiveDir[] = "/var/lib/house/sensor";
-static const char SensorArchiveFormat[] = "%04d-%02d-%02d.csv";
 
+// The depth of the event ring can be set using option recent.depth.
+//
 #define SENSOR_EVENT_DEPTH (SENSOR_DATABASE_BLOCK*128)
+#define SENSOR_EVENT_MINIMUM 16
+
+static SensorEvent *SensorEventLog = 0;
+static int SensorEventDepth = SENSOR_EVENT_DEPTH;
+static int SensorEventCursor = 0;
+
+// The events are stored in sequence order, the first event (sequence 1)
+// being stored at index 0. The slot at SensorEventCursor is always kept
+// empty, so the log holds at most SensorEventDepth-1 events.
+//
+static long long SensorEventSequence = 0; // Sequence of the latest event.
+
+static long long SensorSkipped = 0; // Values within the deadband.
+
+
+// Format a numeric value (in thousandths) without trailing zeroes.
+// The buffer must be at least 24 characters.
+//
+const char *housesensor_db_format (char *buffer, long long value) {
+
+    char *p = buffer + 23;
+    unsigned long long magnitude = (value < 0) ? -value : value;
+    unsigned int fraction = (unsigned int)(magnitude % SENSOR_SCALE);
+    int digits = 3;
+
+    *p = 0;
+    while (digits > 0 && (fraction % 10) == 0) {
+        fraction /= 10;
+        digits -= 1;
+    }
+    if (digits > 0) {
+        while (digits-- > 0) {
+            *(--p) = '0' + (fraction % 10);
+            fraction /= 10;
+        }
+        *(--p) = '.';
+    }
+    magnitude /= SENSOR_SCALE;
+    do {
+        *(--p) = '0' + (magnitude % 10);
+        magnitude /= 10;
+    } while (magnitude);
+    if (value < 0) *(--p) = '-';
+    return p;
+}
+
+// Decode a string as a number in thousandths. Return 0 if this is not
+// a plain decimal number, or if it has more than 3 significant decimals:
+// such a value could not be stored as a number without changing it.
+// (The exponent and hexadecimal forms accepted by strtod are rejected.)
+//
+int housesensor_db_parse (const char *text, long long *value) {
+
+    static const unsigned long long limit = 900000000000000000ULL;
+    unsigned long long magnitude = 0;
+    int negative = 0;
+    int decimals = 0;
+    int digits = 0;
+
+    if (*text == '-') {
+        negative = 1;
+        text += 1;
+    }
+    for (; *text >= '0' && *text <= '9'; ++text, ++digits) {
+        if (magnitude >= limit) return 0;
+        magnitude = (magnitude * 10) + (*text - '0');
+    }
+    if (*text == '.') {
+        for (++text; *text >= '0' && *text <= '9'; ++text, ++digits) {
+            if (decimals >= 3) {
+                if (*text != '0') return 0;
+                continue;
+            }
+            if (magnitude >= limit) return 0;
+            magnitude = (magnitude * 10) + (*text - '0');
+            decimals += 1;
+        }
+    }
+    if (*text != 0 || digits == 0) return 0;
+
+    for (; decimals < 3; ++decimals) {
+        if (magnitude >= limit) return 0;
+        magnitude *= 10;
+    }
+    *value = negative ? -(long long)magnitude : (long long)magnitude;
+    return 1;
+}
+
+static const char *SensorValue (const SensorContext *s, char *buffer) {
+    if (s->text) return s->text;
+    return housesensor_db_format (buffer, s->value);
+}
 
-SensorEvent SensorEventLog[SENSOR_EVENT_DEPTH];
-int SensorEventCursor = 0;
+static void SensorRender (SensorContext *s) {
 
+    char number[24];
+    const char *quote = s->text ? "\"" : "";
+
+    housesensor_output_reset (&(s->json), 0);
+
+    if (s->timestamp == 0) {
+        housesensor_output_printf (&(s->json),
+                                   "{\"name\":\"%s\",\"value\":null}",
+                                   s->name);
+    } else if (s->unit[0]) {
+        housesensor_output_printf (&(s->json),
+                                   "{\"name\":\"%s\",\"timestamp\":%ld,"
+                                       "\"value\":%s%s%s,\"unit\":\"%s\"}",
+                                   s->name, (long)s->timestamp, quote,
+                                   SensorValue (s, number), quote, s->unit);
+    } else {
+        housesensor_output_printf (&(s->json),
+                                   "{\"name\":\"%s\",\"timestamp\":%ld,"
+                                       "\"value\":%s%s%s}",
+                                   s->name, (long)s->timestamp,
+                                   quote, SensorValue (s, number), quote);
+    }
+    SensorGeneration += 1;
+}
+
+// Render one event as a JSON object, as listed by housesensor_db_recent()
+// and pushed to the stream subscribers.
+//
+static void SensorEventRender (housesensor_output *buffer,
+                               const char *prefix, long long sequence) {
+
+    SensorEvent *evt = SensorEventLog + (sequence-1) % SensorEventDepth;
+    SensorContext *s = SensorDatabase + evt->sensor;
+    char number[24];
+
+    housesensor_output_printf (buffer,
+              "%s{\"location\":\"%s\",\"name\":\"%s\",\"time\":%lld",
+              prefix, s->location, s->name, (long long)evt->timestamp);
+
+    if (evt->istext) {
+        housesensor_output_printf (buffer,
+                                   ",\"value\":\"%s\"", evt->value.text);
+    } else {
+        housesensor_output_printf (buffer, ",\"value\":%s",
+                  housesensor_db_format (number, evt->value.number));
+    }
+
+    if (s->unit[0]) {
+        housesensor_output_printf (buffer, ",\"unit\":\"%s\"}", s->unit);
+    } else {
+        housesensor_output_append (buffer, "}", 1);
+    }
+}
+
+static void SensorEventInitialize (void) {
+
+    const char *depth = housesensor_db_option ("recent.depth");
+    if (depth) {
+        SensorEventDepth = atoi(depth);
+        if (SensorEventDepth < SENSOR_EVENT_MINIMUM)
+            SensorEventDepth = SENSOR_EVENT_MINIMUM;
+    }
+    SensorEventLog = calloc (SensorEventDepth, sizeof(SensorEvent));
+    if (!SensorEventLog) {
+        fprintf (stderr, "No enough memory for %d events\n", SensorEventDepth);
+        exit (1);
+    }
+}
 
 static void SensorEventAdd (SensorContext *sensor) {
 
     SensorEvent *evt = SensorEventLog + SensorEventCursor;
-    evt->sensor = sensor;
+
+    if (evt->istext) free (evt->value.text);
+
+    evt->sensor = sensor - SensorDatabase;
     evt->timestamp = sensor->timestamp;
-    if (evt->value) free (evt->value);
-    evt->value = strdup(sensor->value);
+    if (sensor->text) {
+        evt->istext = 1;
+        evt->value.text = strdup (sensor->text);
+        if (!evt->value.text) {
+            fprintf (stderr, "No enough memory for a text event\n");
+            exit (1);
+        }
+    } else {
+        evt->istext = 0;
+        evt->value.number = sensor->value;
+    }
 
+    SensorEventSequence += 1;
     SensorEventCursor += 1;
-    if (SensorEventCursor >= SENSOR_EVENT_DEPTH) SensorEventCursor = 0;
-    SensorEventLog[SensorEventCursor].sensor = 0;
+    if (SensorEventCursor >= SensorEventDepth) SensorEventCursor = 0;
+}
+
+
+static unsigned int SensorHashText (unsigned int hash, const char *text) {
+    while (*text) hash = (hash ^ (unsigned char)(*text++)) * 16777619u;
+    return hash;
 }
 
+static unsigned int SensorHashKey (const char *driver, const char *device) {
 
+    unsigned int hash = SensorHashText (2166136261u, driver); // FNV-1a.
+
+    hash = (hash ^ '.') * 16777619u;
+    return SensorHashText (hash, device);
+}
+
+static void SensorIndexClear (SensorIndex *index) {
+    int i;
+    for (i = 0; i < index->size; ++i) index->slot[i] = -1;
+}
+
+// Make room for count entries. Return 1 if the index had to be resized:
+// it is then empty, and all entries must be inserted again.
+//
+static int SensorIndexReserve (SensorIndex *index, int count) {
+
+    int size = index->size ? index->size : SENSOR_DATABASE_BLOCK*2;
+    int *slot;
+
+    if (2 * count <= index->size) return 0;
+
+    while (2 * count > size) size *= 2;
+    slot = realloc (index->slot, size * sizeof(int));
+    if (!slot) {
+        fprintf (stderr, "No enough memory for %d hash entries\n", size);
+        exit (1);
+    }
+    index->slot = slot;
+    index->size = size;
+    SensorIndexClear (index);
+    return 1;
+}
+
+static void SensorIndexInsert (SensorIndex *index,
+                               unsigned int hash, int entry) {
+
+    unsigned int mask = index->size - 1;
+    unsigned int slot = hash & mask;
+
+    while (index->slot[slot] >= 0) slot = (slot + 1) & mask;
+    index->slot[slot] = entry;
+}
+
+static void SensorHashAdd (int index) {
+
+    int i;
+
+    if (SensorIndexReserve (&SensorHash, SensorCount)) {
+        for (i = 0; i < SensorCount; ++i) {
+            SensorContext *s = SensorDatabase + i;
+            SensorIndexInsert (&SensorHash,
+                               SensorHashKey (s->driver, s->device), i);
+        }
+        return; // The new sensor was rehashed along with all the others.
+    }
+    SensorIndexInsert (&SensorHash,
+                       SensorHashKey (SensorDatabase[index].driver,
+                                      SensorDatabase[index].device), index);
+}
+
+// Search for the active sensor with this driver and device.
+//
+static int SensorHashSearch (const char *driver, const char *device) {
+
+    unsigned int mask;
+    unsigned int slot;
+
+    if (!SensorHash.size) return -1;
+
+    mask = SensorHash.size - 1;
+    for (slot = SensorHashKey (driver, device) & mask;
+         SensorHash.slot[slot] >= 0; slot = (slot + 1) & mask) {
+        SensorContext *s = SensorDatabase + SensorHash.slot[slot];
+        if (s->removed) continue;
+        if (strcmp (s->device, device)) continue;
+        if (strcmp (s->driver, driver)) continue;
+        return SensorHash.slot[slot];
+    }
+    return -1;
+}
+
+// Search for the sensor, active or removed, that matches exactly
+// a sensor line from the configuration.
+//
+static int SensorHashMatch (char **token, int count) {
+
+    unsigned int mask;
+    unsigned int slot;
+
+    if (!SensorHash.size) return -1;
+
+    mask = SensorHash.size - 1;
+    for (slot = SensorHashKey (token[0], token[1]) & mask;
+         SensorHash.slot[slot] >= 0; slot = (slot + 1) & mask) {
+        SensorContext *s = SensorDatabase + SensorHash.slot[slot];
+        if (strcmp (s->device, token[1])) continue;
+        if (strcmp (s->driver, token[0])) continue;
+        if (strcmp (s->location, token[2])) continue;
+        if (strcmp (s->name, token[3])) continue;
+        if (count >= 5) {
+            if (!s->fixed || strcmp (s->unit, token[4])) continue;
+        } else if (s->fixed) continue;
+        return SensorHash.slot[slot];
+    }
+    return -1;
+}
+
+static void SensorLocationAdd (int index) {
+
+    SensorContext *s = SensorDatabase + index;
+    unsigned int hash = SensorHashText (2166136261u, s->location);
+    unsigned int mask;
+    unsigned int slot;
+    SensorLocation *l;
+    int i;
+
+    if (SensorLocationHash.size) {
+        mask = SensorLocationHash.size - 1;
+        for (slot = hash & mask;
+             SensorLocationHash.slot[slot] >= 0; slot = (slot + 1) & mask) {
+            l = SensorLocationDatabase + SensorLocationHash.slot[slot];
+            if (strcmp (l->location, s->location) == 0) {
+                SensorDatabase[l->last].next = index;
+                l->last = index;
+                s->next = -1;
+                return;
+            }
+        }
+    }
+
+    if (SensorLocationCount >= SensorLocationSize) {
+        SensorLocationSize += SENSOR_DATABASE_BLOCK;
+        SensorLocationDatabase =
+            realloc (SensorLocationDatabase,
+                     sizeof(SensorLocation)*SensorLocationSize);
+        if (!SensorLocationDatabase) {
+            fprintf (stderr, "No enough memory for %d locations\n",
+                     SensorLocationSize);
+            exit (1);
+        }
+    }
+    l = SensorLocationDatabase + SensorLocationCount++;
+    l->location = s->location;
+    l->first = l->last = index;
+    s->next = -1;
+
+    if (SensorIndexReserve (&SensorLocationHash, SensorLocationCount)) {
+        for (i = 0; i < SensorLocationCount; ++i) {
+            SensorIndexInsert (&SensorLocationHash,
+                               SensorHashText (2166136261u,
+                                   SensorLocationDatabase[i].location), i);
+        }
+        return;
+    }
+    SensorIndexInsert (&SensorLocationHash, hash, SensorLocationCount - 1);
+}
+
+// Rebuild the list of sensors per location from the active sensors,
+// in the order of the configuration.
+//
+static void SensorLocationRebuild (void) {
+
+    int i;
+
+    SensorLocationCount = 0;
+    SensorIndexClear (&SensorLocationHash);
+    for (i = 0; i < SensorCount; ++i) {
+        if (!SensorDatabase[i].removed) SensorLocationAdd (i);
+    }
+}
+
+static int SensorOptionSearch (const char *name) {
+
+    unsigned int mask;
+    unsigned int slot;
+
+    if (!SensorOptionHash.size) return -1;
+
+    mask = SensorOptionHash.size - 1;
+    for (slot = SensorHashText (2166136261u, name) & mask;
+         SensorOptionHash.slot[slot] >= 0; slot = (slot + 1) & mask) {
+        if (!strcmp (SensorOptionDatabase[SensorOptionHash.slot[slot]].name,
+                     name)) return SensorOptionHash.slot[slot];
+    }
+    return -1;
+}
+
+// Split a line in space-separated tokens. If there are more than max
+// tokens, the last token holds the remainder of the line.
+//
 static int LineSplit (char *buffer, char **token, int max) {
 
     int i, start, count;
 
     for (i = start = count = 0; buffer[i] >= ' '; ++i) {
         if (buffer[i] == ' ') {
-            if (count >= 16) {
-                fprintf (stderr, "too many tokens at %s\n", buffer+i);
-                exit(1);
-            }
+            if (count >= max - 1) break;
             token[count++] = buffer + start;
             do {
                buffer[i] = 0;
@@ -153,23 +672,82 @@ static int LineSplit (char *buffer, char **token, int max) {
             start = i;
         }
     }
+    while (buffer[i] >= ' ') ++i;
     buffer[i] = 0;
     token[count++] = buffer + start;
     return count;
 }
 
 static void AddOption (char **token, int count) {
-    SensorOption *o = SensorOptionDatabase + SensorOptionCount++;
+
+    SensorOption *o;
+    int i = SensorOptionSearch (token[1]);
+
+    if (i >= 0) {
+        o = SensorOptionDatabase + i;
+        if (o->loaded == SensorConfigGeneration) return; // The first wins.
+        o->loaded = SensorConfigGeneration;
+
+        // The previous value is not freed: it might still be referenced
+        // by a module that read it before.
+        //
+        if (!o->value || strcmp (o->value, token[2]))
+            o->value = strdup(token[2]);
+        return;
+    }
+
+    if (SensorOptionCount >= SensorOptionSize) {
+        SensorOptionSize += SENSOR_DATABASE_BLOCK;
+        SensorOptionDatabase =
+            realloc (SensorOptionDatabase,
+                     sizeof(SensorOption)*SensorOptionSize);
+        if (!SensorOptionDatabase) {
+            fprintf (stderr,
+                     "No enough memory for %d options\n", SensorOptionSize);
+            exit (1);
+        }
+    }
+    o = SensorOptionDatabase + SensorOptionCount++;
     o->name = strdup(token[1]);
     o->value = strdup(token[2]);
+    o->loaded = SensorConfigGeneration;
+
+    if (SensorIndexReserve (&SensorOptionHash, SensorOptionCount)) {
+        for (i = 0; i < SensorOptionCount; ++i) {
+            SensorIndexInsert (&SensorOptionHash,
+                               SensorHashText (2166136261u,
+                                   SensorOptionDatabase[i].name), i);
+        }
+        return;
+    }
+    SensorIndexInsert (&SensorOptionHash,
+                       SensorHashText (2166136261u, o->name),
+                       SensorOptionCount - 1);
 }
 
+// Add a sensor, unless the same sensor is already known. A sensor that
+// is listed again with the same location, name and unit keeps its
+// handle and its latest value. A sensor that was changed is added as
+// a new sensor and its former entry is removed, so that the recent
+// measurements keep the location and name they were recorded under.
+//
 static void AddSensor (char **token, int count) {
 
-    int i;
-    SensorContext *s = SensorDatabase + SensorCount++;
+    SensorContext *s;
+    int i = SensorHashMatch (token, count);
+
+    if (i >= 0) {
+        s = SensorDatabase + i;
+        s->loaded = SensorConfigGeneration;
+        if (s->removed) {
+            s->removed = 0;
+            s->logged = 0; // Always record its first value when back.
+            SensorRender (s);
+        }
+        return;
+    }
 
-    if (SensorCount > SensorDatabaseSize) {
+    if (SensorCount >= SensorDatabaseSize) {
         SensorDatabaseSize += SENSOR_DATABASE_BLOCK;
         SensorDatabase =
             realloc (SensorDatabase, sizeof(SensorContext)*SensorDatabaseSize);
@@ -178,37 +756,35 @@ static void AddSensor (char **token, int count) {
                      "No enough memory for %d sensors\n", SensorDatabaseSize);
             exit (1);
         }
-        s = SensorDatabase + SensorCount - 1;
     }
+    s = SensorDatabase + SensorCount++;
 
     s->driver = strdup(token[0]);
     s->device = strdup(token[1]);
     s->location = strdup(token[2]);
     s->name = strdup(token[3]);
-    if (count >= 5)
+    if (count >= 5) {
         strtcpy (s->unit, token[4], sizeof(s->unit));
-    else
-        s->unit[0] = 0;
-    s->value[0] = 0;
-    s->timestamp = 0;
-    for (i = 0; i < SensorLocationCount; ++i) {
-        if (strcmp(SensorLocationDatabase[i].location, s->location) == 0)
-            break;
-    }
-    if (i >= SensorLocationCount) {
-        SensorLocation *l = SensorLocationDatabase + SensorLocationCount++;
-        if (SensorLocationCount > SENSOR_DATABASE_BLOCK) {
-            fprintf (stderr, "Too many locations\n");
-            exit (1);
-        }
-        l->location = s->location;
-        l->first = SensorCount - 1;
-        s->next = -1;
+        s->fixed = 1;
     } else {
-        SensorLocation *l = SensorLocationDatabase + i;
-        s->next = l->first;
-        l->first = SensorCount - 1;
+        s->unit[0] = 0;
+        s->fixed = 0;
     }
+    s->removed = 0;
+    s->loaded = SensorConfigGeneration;
+    s->value = 0;
+    s->filtered = 0;
+    s->deadband = 0;
+    s->relative = 0;
+    s->heartbeat = 0;
+    s->recorded = 0;
+    s->logged = 0;
+    s->text = 0;
+    s->timestamp = 0;
+    s->next = -1;
+    memset (&(s->json), 0, sizeof(s->json));
+    SensorRender (s);
+    SensorHashAdd (SensorCount - 1);
 }
 
 static void DecodeLine (char *buffer) {
@@ -235,24 +811,162 @@ static void DecodeLine (char *buffer) {
     AddSensor (token, count);
 }
 
-static void LoadConfig (const char *name) {
+// The recording policy of a sensor is set by options, either for this
+// sensor (record.<policy>.<location>.<name>) or for all (record.<policy>).
+//
+static const char *SensorPolicyOption (const char *policy,
+                                       const SensorContext *s) {
 
-    char buffer[1024];
-    FILE *f = fopen (name, "r");
+    char name[256];
+    const char *value;
 
-    if (f == 0) {
-        fprintf (stderr, "cannot access configuration file %s\n", name);
-        exit(1);
+    snprintf (name, sizeof(name),
+              "record.%s.%s.%s", policy, s->location, s->name);
+    value = housesensor_db_option (name);
+    if (value) return value;
+
+    snprintf (name, sizeof(name), "record.%s", policy);
+    return housesensor_db_option (name);
+}
+
+static void SensorPolicyResolve (void) {
+
+    int i;
+
+    for (i = 0; i < SensorCount; ++i) {
+        SensorContext *s = SensorDatabase + i;
+        const char *deadband;
+        const char *relative;
+        const char *heartbeat;
+
+        if (s->removed) continue;
+
+        deadband = SensorPolicyOption ("deadband", s);
+        relative = SensorPolicyOption ("relative", s);
+        heartbeat = SensorPolicyOption ("heartbeat", s);
+        s->filtered = (deadband || relative || heartbeat);
+        s->deadband = 0;
+        s->relative = 0;
+        if (deadband && housesensor_db_parse (deadband, &s->deadband)) {
+            if (s->deadband < 0) s->deadband = -s->deadband;
+        }
+        if (relative && housesensor_db_parse (relative, &s->relative)) {
+            if (s->relative < 0) s->relative = -s->relative;
+        }
+        s->heartbeat = heartbeat ? atoi(heartbeat) : SENSOR_HEARTBEAT;
+        if (s->heartbeat < 0) s->heartbeat = 0;
     }
+}
+
+// Load the configuration, or apply the changes made since it was last
+// loaded. Return 0 if the file could not be read.
+//
+static int LoadConfig (const char *name) {
 
-    while (!feof(f)) {
-        buffer[0] = 0;
-        fgets (buffer, sizeof(buffer), f);
+    char *buffer = 0;
+    size_t size = 0;
+    int added = SensorCount;
+    int removed = 0;
+    int i;
+    FILE *f = fopen (name, "r");
+
+    if (f == 0) return 0;
+
+    SensorConfigGeneration += 1;
+
+    while (getline (&buffer, &size, f) >= 0) {
         if (buffer[0] != '#' && buffer[0] > ' ') {
             DecodeLine (buffer);
         }
     }
+    free (buffer);
     fclose(f);
+
+    for (i = 0; i < SensorCount; ++i) {
+        SensorContext *s = SensorDatabase + i;
+        if (s->loaded != SensorConfigGeneration && !s->removed) {
+            s->removed = 1;
+            removed += 1;
+        }
+    }
+    for (i = 0; i < SensorOptionCount; ++i) {
+        SensorOption *o = SensorOptionDatabase + i;
+        if (o->loaded != SensorConfigGeneration) o->value = 0;
+    }
+    SensorPolicyResolve ();
+    SensorLocationRebuild ();
+    SensorGeneration += 1;
+
+    if (echttp_isdebug())
+        printf ("Loaded %s: %d sensors added, %d removed\n",
+                name, SensorCount - added, removed);
+    return 1;
+}
+
+static void SensorConfigWatchInitialize (void) {
+
+    char directory[1024];
+    struct stat info;
+    char *slash;
+
+    if (stat (SensorConfigName, &info) == 0)
+        SensorConfigChanged = info.st_mtime;
+
+    // Watch the directory, since an editor often replaces the file.
+    //
+    strtcpy (directory, SensorConfigName, sizeof(directory));
+    slash = strrchr (directory, '/');
+    if (slash == directory) slash[1] = 0;
+    else if (slash) *slash = 0;
+    else strcpy (directory, ".");
+
+    SensorConfigWatch = inotify_init1 (IN_NONBLOCK|IN_CLOEXEC);
+    if (SensorConfigWatch >= 0) {
+        if (inotify_add_watch (SensorConfigWatch, directory,
+                               IN_CLOSE_WRITE|IN_MOVED_TO) < 0) {
+            close (SensorConfigWatch);
+            SensorConfigWatch = -1;
+        }
+    }
+}
+
+static void SensorConfigUpdate (void) {
+
+    char buffer[4096]
+        __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    const char *base = strrchr (SensorConfigName, '/');
+    struct stat info;
+    int changed = 0;
+
+    base = base ? base + 1 : SensorConfigName;
+
+    if (SensorConfigWatch < 0) {
+        if (stat (SensorConfigName, &info) == 0 &&
+            info.st_mtime != SensorConfigChanged) {
+            SensorConfigChanged = info.st_mtime;
+            changed = 1;
+        }
+    } else {
+        for (;;) {
+            const struct inotify_event *event;
+            char *p;
+            ssize_t length = read (SensorConfigWatch, buffer, sizeof(buffer));
+            if (length <= 0) break;
+
+            for (p = buffer; p < buffer + length;
+                 p += sizeof(struct inotify_event) + event->len) {
+                event = (const struct inotify_event *)p;
+                if (event->mask & IN_Q_OVERFLOW) changed = 1;
+                else if (event->len && !strcmp (event->name, base))
+                    changed = 1;
+            }
+        }
+    }
+    if (!changed) return;
+
+    if (!LoadConfig (SensorConfigName))
+        fprintf (stderr, "cannot access configuration file %s\n",
+                 SensorConfigName);
 }
 
 const char *housesensor_db_device_first (const char *driver) {
@@ -267,6 +981,7 @@ const char *housesensor_db_device_next (const char *driver) {
 
     for (i = SensorDriverCursor; i < SensorCount; ++i) {
         SensorContext *s = SensorDatabase + i;
+        if (s->removed) continue;
         if (strcmp (s->driver, driver) == 0) {
             SensorDriverCursor = i + 1;
             return s->device;
@@ -275,78 +990,165 @@ const char *housesensor_db_device_next (const char *driver) {
     return 0;
 }
 
-void housesensor_db_set (const char *driver, const char *device,
-                         const char *value, const char *unit) {
-    int i;
+int housesensor_db_handle (const char *driver, const char *device) {
+    return SensorHashSearch (driver, device);
+}
+
+// Return 1 if a new numeric value must be recorded, i.e. is outside
+// the deadband of the last recorded value.
+//
+static int SensorOutsideBand (const SensorContext *s, long long value) {
+
+    long long delta = value - s->recorded;
+    long long band = s->deadband;
+
+    if (!s->filtered || s->text || !s->logged) return 1;
+
+    if (s->relative) {
+        long long reference = (s->recorded < 0) ? -s->recorded : s->recorded;
+        reference = (reference * s->relative) / (100 * SENSOR_SCALE);
+        if (reference > band) band = reference;
+    }
+    if (delta < 0) delta = -delta;
+    return delta > band;
+}
+
+static void SensorRecord (SensorContext *s, const char *unit, int changed) {
+
     time_t now = time(0);
-    SensorContext *s;
+    char number[24];
+    char line[1024];
+    const char *value;
+    int length;
 
-    // Search for that exact sensor.
-    //
-    for (i = 0; i < SensorCount; ++i) {
-        s = SensorDatabase + i;
-        if (strcmp (s->device, device)) continue;
-        if (strcmp (s->driver, driver)) continue;
-        break;
+    if (unit && s->unit[0] == 0) {
+        strtcpy (s->unit, unit, sizeof(s->unit));
+        changed = 1;
     }
+    s->timestamp = now;
+    SensorRender (s);
 
-    if (i < SensorCount) {
-        strtcpy (s->value, value, sizeof(s->value));
+    value = SensorValue (s, number);
+    if (echttp_isdebug()) printf ("Set %s.%s to %s %s\n",
+                                  s->driver, s->device, value, s->unit);
 
-        if (unit && s->unit[0] == 0) {
-            strtcpy (s->unit, unit, sizeof(s->unit));
-        }
-        s->timestamp = now;
-        if (echttp_isdebug()) printf ("Set %s.%s to %s %s\n",
-                                      driver, device, s->value, s->unit);
+    if (!s->text) housesensor_rollup_add (s - SensorDatabase,
+                                          s->location, s->name, s->unit,
+                                          now, s->value);
 
-        if (SensorLog == 0) {
-            SensorLog = fopen (SensorLogName, "a");
-        }
-        if (SensorLog) {
-            fprintf (SensorLog, "%lld,%s,%s,%s,%s\n",
-                     (long long)now, s->location, s->name, value, s->unit);
-            SensorLogLastWrite = now;
+    if (s->filtered && !changed && s->logged) {
+        if (!s->heartbeat || now < s->logged + s->heartbeat) {
+            SensorSkipped += 1;
+            return;
         }
-        SensorEventAdd (s);
+    }
+    s->logged = now;
+    s->recorded = s->value;
+
+    length = snprintf (line, sizeof(line), "%lld,%s,%s,%s,%s\n",
+                       (long long)now, s->location, s->name, value, s->unit);
+    if (length >= sizeof(line)) {
+        length = sizeof(line) - 1;
+        line[length-1] = '\n';
+    }
+    housesensor_journal_add (line, length);
+    SensorEventAdd (s);
+
+    if (housesensor_stream_active ()) {
+        static housesensor_output event;
+        housesensor_output_reset (&event, 0);
+        SensorEventRender (&event, "", SensorEventSequence);
+        housesensor_stream_publish (SensorEventSequence,
+                                    event.data, event.length);
     }
 }
 
-const char *housesensor_db_option (const char *name) {
+void housesensor_db_set_number (int handle,
+                                long long value, int decimals,
+                                const char *unit) {
 
-    int i;
+    SensorContext *s;
+    int changed;
 
-    for (i = 0; i < SensorOptionCount; ++i) {
-        SensorOption *s = SensorOptionDatabase + i;
-        if (strcmp (s->name, name) == 0) {
-            return s->value;
-        }
+    if (handle < 0 || handle >= SensorCount) return;
+    s = SensorDatabase + handle;
+    if (s->removed) return;
+
+    for (; decimals < 3; ++decimals) value *= 10;
+    for (; decimals > 4; --decimals) value /= 10;
+    if (decimals > 3) value = (value + ((value < 0) ? -5 : 5)) / 10;
+
+    changed = SensorOutsideBand (s, value);
+    if (s->text) {
+        free (s->text);
+        s->text = 0;
     }
-    return 0;
+    s->value = value;
+    SensorRecord (s, unit, changed);
 }
 
-const char *housesensor_db_latest (void) {
+void housesensor_db_set_handle (int handle,
+                                const char *value, const char *unit) {
+
+    SensorContext *s;
+    long long number;
+    int changed = 0;
 
-    static char buffer[65537];
+    if (handle < 0 || handle >= SensorCount) return;
+    s = SensorDatabase + handle;
+    if (s->removed) return;
 
-    char *prefix0 = "";
-    char host[256];
-    int length;
+    if (housesensor_db_parse (value, &number)) {
+        housesensor_db_set_number (handle, number, 3, unit);
+        return;
+    }
+
+    // Non-numeric values are rare: the text is only reallocated when
+    // it changes.
+    //
+    if (!s->text || strcmp (s->text, value)) {
+        if (s->text) free (s->text);
+        s->text = strdup (value);
+        changed = 1;
+    }
+    SensorRecord (s, unit, changed);
+}
+
+void housesensor_db_set (const char *driver, const char *device,
+                         const char *value, const char *unit) {
+    housesensor_db_set_handle (SensorHashSearch (driver, device), value, unit);
+}
+
+const char *housesensor_db_option (const char *name) {
+
+    int i = SensorOptionSearch (name);
+
+    return (i >= 0) ? SensorOptionDatabase[i].value : 0;
+}
+
+long housesensor_db_generation (void) {
+    return SensorConfigGeneration;
+}
+
+const char *housesensor_db_host (void) {
+    return SensorHost;
+}
+
+static void SensorLatestAssemble (void) {
+
+    const char *prefix0 = "";
     int i, j;
 
-    gethostname (host, sizeof(host));
-    snprintf (buffer, sizeof(buffer),
-             "{\"host\":\"%s\",\"proxy\":\"%s\",\"timestamp\":%ld,\"sensor\":{",
-             host, houseportal_server(), (long)time(0));
-    length = strlen(buffer);
+    housesensor_output_reset (&SensorLatest, SENSOR_LATEST_HEADER);
 
     for (j = 0; j < SensorLocationCount; ++j) {
 
-        const char *prefix = "";
+        const char *location = SensorLocationDatabase[j].location;
 
-        snprintf (buffer+length, sizeof(buffer)-length, "%s\"%s\":[",
-                  prefix0, SensorLocationDatabase[j].location);
-        length += strlen(buffer+length);
+        housesensor_output_string (&SensorLatest, prefix0);
+        housesensor_output_append (&SensorLatest, "\"", 1);
+        housesensor_output_string (&SensorLatest, location);
+        housesensor_output_append (&SensorLatest, "\":[", 3);
         prefix0 = ",";
 
         for (i = SensorLocationDatabase[j].first;
@@ -354,157 +1156,179 @@ const char *housesensor_db_latest (void) {
 
             SensorContext *s = SensorDatabase + i;
 
-            snprintf (buffer+length, sizeof(buffer)-length,
-                      "%s{\"name\":\"%s\"", prefix, s->name);
-            length += strlen(buffer+length);
-            prefix = ",";
-
-            if (s->timestamp) {
-                snprintf (buffer+length, sizeof(buffer)-length,
-                          ",\"timestamp\":%ld", (long) s->timestamp);
-                length += strlen(buffer+length);
-            }
-
-            if (s->value[0] == 0) {
-                snprintf (buffer+length, sizeof(buffer)-length,
-                          ",\"value\":null}");
-            } else if (s->unit[0]) {
-                snprintf (buffer+length, sizeof(buffer)-length,
-                          ",\"value\":%s,\"unit\":\"%s\"}", s->value, s->unit);
-            } else {
-                snprintf (buffer+length, sizeof(buffer)-length, 
-                          ",\"value\":\"%s\"}", s->value);
-            }
-            length += strlen(buffer+length);
+            housesensor_output_append (&SensorLatest,
+                                       s->json.data, s->json.length);
+            if (s->next >= 0) housesensor_output_append (&SensorLatest, ",", 1);
         }
-        snprintf (buffer+length, sizeof(buffer)-length, "]");
-        length += strlen(buffer+length);
+        housesensor_output_append (&SensorLatest, "]", 1);
     }
-    snprintf (buffer+length, sizeof(buffer)-length, "}}");
-    return buffer;
+    housesensor_output_append (&SensorLatest, "}}", 2);
+    SensorLatestGeneration = SensorGeneration;
 }
 
-const char *housesensor_db_recent (void) {
-
-    static char buffer[SENSOR_EVENT_DEPTH*64];
-    const char *prefix = "";
-    char host[256];
-    int length;
-    int i;
-
-    gethostname (host, sizeof(host));
+const char *housesensor_db_latest_tag (void) {
 
-    snprintf (buffer, sizeof(buffer),
-              "{\"sensor\":{\"timestamp\":%lld,\"host\":\"%s\",\"recent\":[",
-              (long long)time(0), host);
-    length = strlen(buffer);
+    static char tag[64];
 
-    for (i = SensorEventCursor + 1; i != SensorEventCursor; ++i) {
-        if (i >= SENSOR_EVENT_DEPTH) {
-            i = 0;
-            if (!SensorEventCursor) break;
-        }
-        SensorContext *s = SensorEventLog[i].sensor;
-        if (s) {
-
-            const char *value = SensorEventLog[i].value;
-            time_t timestamp = SensorEventLog[i].timestamp;
-
-            snprintf (buffer+length, sizeof(buffer)-length,
-                      "%s{\"location\":\"%s\",\"name\":\"%s\",\"time\":%lld",
-                      prefix, s->location, s->name, (long long)timestamp);
-            length += strlen(buffer+length);
-            prefix = ",";
-
-            if (s->unit[0]) {
-                snprintf (buffer+length, sizeof(buffer)-length,
-                          ",\"value\":%s,\"unit\":\"%s\"}", value, s->unit);
-            } else {
-                snprintf (buffer+length, sizeof(buffer)-length, 
-                          ",\"value\":\"%s\"}", value);
-            }
-            length += strlen(buffer+length);
-        }
-    }
-    snprintf (buffer+length, sizeof(buffer)-length, "]}}");
-    return buffer;
+    snprintf (tag, sizeof(tag), "\"%lld-%ld\"",
+              (long long)SensorStartTime, SensorGeneration);
+    return tag;
 }
 
-const char *housesensor_db_history (void) {
+const char *housesensor_db_latest (void) {
 
-    static char buffer[65537];
+    char header[SENSOR_LATEST_HEADER];
 
-    DIR *d = opendir (SensorArchiveDir);
-    char host[256];
+    if (SensorLatestGeneration != SensorGeneration) SensorLatestAssemble ();
 
-    gethostname (host, sizeof(host));
+    snprintf (header, sizeof(header),
+              "{\"host\":\"%s\",\"proxy\":\"%s\",\"timestamp\":%ld,\"sensor\":{",
+              SensorHost, houseportal_server(), (long)time(0));
+    return housesensor_output_prefix (&SensorLatest,
+                                      SENSOR_LATEST_HEADER, header);
+}
 
-    if (d) {
-        int length;
-        struct dirent *de;
-        const char *prefix = "";
+const char *housesensor_db_recent (long long since) {
 
-        snprintf (buffer, sizeof(buffer),
-                  "{\"sensor\":{\"timestamp\":%lld,\"host\":\"%s\",\"history\":[",
-                  (long long)time(0), host);
-        length = strlen(buffer);
+    static housesensor_output buffer;
+    const char *prefix = "";
+    long long oldest = SensorEventSequence - SensorEventDepth; // Gone.
+    long long lost = 0;
+    long long sequence;
 
-        while ((de = readdir(d))) {
-            if (de->d_name[0] == '.') continue;
-            snprintf (buffer+length, sizeof(buffer)-length,
-                      "%s\"%10.10s\"", prefix, de->d_name);
-            length += strlen(buffer+length);
-            prefix = ",";
-        }
-        snprintf (buffer+length, sizeof(buffer)-length, "]}}");
-        closedir(d);
-        return buffer;
+    // A cursor from the future most likely comes from a previous run
+    // of this service: return all that is available.
+    //
+    if (since > SensorEventSequence || since < 0) since = 0;
+    if (since < oldest) {
+        if (since > 0) lost = oldest - since; // The client fell behind.
+        since = oldest;
     }
 
-    snprintf (buffer, sizeof(buffer),
-              "{\"sensor\":{\"timestamp\":%lld,\"host\":\"%s\",\"history\":[]}}",
-              (long long)time(0), host);
-    return buffer;
+    housesensor_output_reset (&buffer, 0);
+    housesensor_output_printf (&buffer,
+              "{\"sensor\":{\"timestamp\":%lld,\"host\":\"%s\","
+                  "\"next\":%lld,",
+              (long long)time(0), SensorHost, SensorEventSequence);
+    if (lost > 0)
+        housesensor_output_printf (&buffer, "\"lost\":%lld,", lost);
+    housesensor_output_string (&buffer, "\"recent\":[");
+
+    for (sequence = since + 1; sequence <= SensorEventSequence; ++sequence) {
+        SensorEventRender (&buffer, prefix, sequence);
+        prefix = ",";
+    }
+    housesensor_output_append (&buffer, "]}}", 3);
+    return buffer.data;
 }
 
-static void housesensor_db_backup (const struct tm *t, const char *method) {
+const char *housesensor_db_history (const char *from, const char *to,
+                                    int limit) {
+
+    static housesensor_output buffer;
 
-    char archivename[256];
-    char command[1024];
+    const char *prefix = "";
+    int count = housesensor_archive_count ();
+    int i = from ? housesensor_archive_search (from) : 0;
+
+    housesensor_output_reset (&buffer, 0);
+    housesensor_output_printf (&buffer,
+              "{\"sensor\":{\"timestamp\":%lld,\"host\":\"%s\",\"history\":[",
+              (long long)time(0), SensorHost);
+
+    for (; i < count; ++i) {
+        const char *day = housesensor_archive_day (i);
+        if (to && strcmp (day, to) > 0) break;
+        if (limit-- == 0) break;
+        housesensor_output_append (&buffer, prefix, strlen(prefix));
+        housesensor_output_append (&buffer, "\"", 1);
+        housesensor_output_append (&buffer, day, 10);
+        housesensor_output_append (&buffer, "\"", 1);
+        prefix = ",";
+    }
+    housesensor_output_append (&buffer, "]", 1);
+
+    // Tell the client where to continue if the list was truncated.
+    //
+    if (i < count) {
+        const char *day = housesensor_archive_day (i);
+        if (!to || strcmp (day, to) <= 0)
+            housesensor_output_printf (&buffer, ",\"next\":\"%s\"", day);
+    }
+    housesensor_output_append (&buffer, "}}", 2);
+    return buffer.data;
+}
 
-    snprintf (archivename, sizeof(archivename), SensorArchiveFormat,
-              t->tm_year+1900, t->tm_mon+1, t->tm_mday);
+void housesensor_db_metrics (void) {
 
-    snprintf (command, sizeof(command), "%s %s %s/%s",
-              method, SensorLogName, SensorArchiveDir, archivename);
+    int active = 0;
+    int i;
 
-    system (command);
+    for (i = 0; i < SensorCount; ++i) {
+        if (!SensorDatabase[i].removed) active += 1;
+    }
+    housesensor_metrics_declare ("housesensor_sensors", "gauge",
+                                 "Number of sensors configured.");
+    housesensor_metrics_value (0, 0, active);
+
+    housesensor_metrics_declare ("housesensor_measurements_total", "counter",
+                                 "Measurements recorded since startup.");
+    housesensor_metrics_value (0, 0, SensorEventSequence);
+
+    housesensor_metrics_declare ("housesensor_measurements_skipped_total",
+                                 "counter",
+                                 "Measurements not recorded (deadband).");
+    housesensor_metrics_value (0, 0, SensorSkipped);
+
+    housesensor_metrics_declare ("housesensor_log_bytes_total", "counter",
+                                 "Bytes written to the CSV log.");
+    housesensor_metrics_value (0, 0, housesensor_journal_bytes());
+
+    housesensor_metrics_declare ("housesensor_log_lines_total", "counter",
+                                 "Lines written to the CSV log.");
+    housesensor_metrics_value (0, 0, housesensor_journal_lines());
+
+    housesensor_metrics_declare ("housesensor_log_lines_dropped_total",
+                                 "counter",
+                                 "Lines that could not be written to the log.");
+    housesensor_metrics_value (0, 0, housesensor_journal_dropped());
 }
 
 void housesensor_db_background (time_t now) {
 
     static time_t LastHourlyBackup = 0;
+    static time_t LastRollupFlush = 0;
 
     struct tm *t;
     time_t onehourbefore = now - 3600;
 
-    if (SensorLog && now > SensorLogLastWrite + 10) {
+    // This is the single point where the measurements recorded since
+    // the last call are written to the log.
+    //
+    housesensor_journal_flush ();
 
-        fclose (SensorLog);
-        SensorLog = 0;
+    SensorConfigUpdate ();
 
-        t = localtime (&onehourbefore);
+    t = localtime (&onehourbefore);
 
-        if (t->tm_hour == 23 && now > SensorLogLastMove + 3601) {
+    if (t->tm_hour == 23 && now > SensorLogLastMove + 3601) {
 
-            housesensor_db_backup (t, "mv");
-            SensorLogLastMove = LastHourlyBackup = now;
+        housesensor_journal_close ();
+        housesensor_archive_move (t);
+        SensorLogLastMove = LastHourlyBackup = now;
 
-        } else if (onehourbefore > LastHourlyBackup) {
+    } else if (onehourbefore > LastHourlyBackup) {
 
-            housesensor_db_backup (localtime (&now), "cp");
-            LastHourlyBackup = now;
-        }
+        housesensor_archive_save (localtime (&now));
+        LastHourlyBackup = now;
+    }
+
+    // The closed rollup buckets are written every minute, so that only
+    // a few of them are ever kept in memory.
+    //
+    if (now >= LastRollupFlush + 60) {
+        housesensor_rollup_flush (now);
+        LastRollupFlush = now;
     }
 }
 
@@ -512,29 +1336,35 @@ void housesensor_db_initialize (int argc, const char **argv) {
 
     struct tm *t;
     time_t yesterday = time(0) - 3600;
-    const char *config = "/etc/house/sensor.config";
 
     int i;
     for (i = 1; i < argc; ++i) {
-        echttp_option_match ("-config=", argv[i], &config);
+        echttp_option_match ("-config=", argv[i], &SensorConfigName);
     }
 
-    LoadConfig (config);
+    SensorStartTime = time(0);
+    gethostname (SensorHost, sizeof(SensorHost));
+
+    if (!LoadConfig (SensorConfigName)) {
+        fprintf (stderr,
+                 "cannot access configuration file %s\n", SensorConfigName);
+        exit(1);
+    }
+    SensorConfigWatchInitialize ();
+    if (housesensor_db_option ("log.file"))
+        SensorLogName = housesensor_db_option ("log.file");
+
+    SensorEventInitialize ();
+    housesensor_journal_initialize (SensorLogName);
+    housesensor_archive_initialize (SensorLogName);
+    housesensor_query_initialize (SensorLogName);
 
     // If we start at midnight, and yesterday's log already exists,
     // do not re-archive today's data as if it was yesterday's.
     //
     t = localtime (&yesterday);
-    if (t->tm_hour == 23) {
-        FILE *f;
-        char name[1024];
-        snprintf (name, sizeof(name), SensorArchiveFormat,
-                  t->tm_year+1900, t->tm_mon+1, t->tm_mday);
-        f = fopen(name, "r");
-        if (f) {
-            SensorLogLastMove = yesterday + 3600;
-            fclose(f);
-        }
+    if (t->tm_hour == 23 && housesensor_archive_exists (t)) {
+        SensorLogLastMove = yesterday + 3600;
     }
 }
 
@@ -23,13 +23,28 @@
 void housesensor_db_initialize (int argc, const char **argv);
 void housesensor_db_set (const char *driver, const char *device,
                          const char *value, const char *unit);
+int  housesensor_db_handle (const char *driver, const char *device);
+void housesensor_db_set_handle (int handle,
+                                const char *value, const char *unit);
+void housesensor_db_set_number (int handle,
+                                long long value, int decimals,
+                                const char *unit);
 const char *housesensor_db_device_first (const char *driver);
 const char *housesensor_db_device_next (const char *driver);
 const char *housesensor_db_option (const char *name);
+long housesensor_db_generation (void);
+const char *housesensor_db_host (void);
+
+const char *housesensor_db_format (char *buffer, long long value);
+int housesensor_db_parse (const char *text, long long *value);
 
 const char *housesensor_db_latest (void);
-const char *housesensor_db_recent (void);
-const char *housesensor_db_history (void);
+const char *housesensor_db_latest_tag (void);
+const char *housesensor_db_recent (long long since);
+const char *housesensor_db_history (const char *from, const char *to,
+                                    int limit);
+
+void housesensor_db_metrics (void);
 
 void housesensor_db_background (time_t now);
 
@@ -0,0 +1,115 @@
+/* housesensor - A simple home web server for measurements.
+ *
+ * Copyright 2019, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housesensor_driver.c - The table of sensor drivers.
+ *
+ * SYNOPSIS:
+ *
+ * Each driver reads one type of sensor. A driver is selected by the
+ * first item of the sensor lines in the configuration: a driver is
+ * initialized only if at least one sensor uses it. Each driver is
+ * responsible for scheduling its own reads, typically from its
+ * background function, and for registering its own file descriptors,
+ * if any, with echttp_listen().
+ *
+ * void housesensor_driver_initialize (int argc, const char **argv);
+ *
+ *    Initialize the drivers that are used in the configuration.
+ *
+ * void housesensor_driver_background (time_t now);
+ *
+ *    Call the background function of each driver in use. A driver that
+ *    was not used before is initialized when a sensor for it is added
+ *    to the configuration.
+ *
+ * void housesensor_driver_metrics (void);
+ *
+ *    Report the metrics of each driver in use (see housesensor_metrics.c).
+ */
+
+#include "housesensor.h"
+#include "housesensor_db.h"
+#include "housesensor_driver.h"
+#include "housesensor_w1.h"
+#include "housesensor_hwmon.h"
+#include "housesensor_iio.h"
+
+
+static const housesensor_driver DriverTable[] = {
+    {"w1", housesensor_w1_initialize,
+           housesensor_w1_background, housesensor_w1_metrics},
+    {"hwmon", housesensor_hwmon_initialize,
+              housesensor_hwmon_background, housesensor_hwmon_metrics},
+    {"iio", housesensor_iio_initialize,
+            housesensor_iio_background, housesensor_iio_metrics},
+    {0, 0, 0, 0}
+};
+
+static char DriverActive[sizeof(DriverTable) / sizeof(DriverTable[0])];
+
+static int DriverArgc = 0;
+static const char **DriverArgv = 0;
+static long DriverGeneration = 0;
+
+
+static void DriverActivate (void) {
+
+    int i;
+
+    for (i = 0; DriverTable[i].name; ++i) {
+        if (DriverActive[i]) continue;
+        if (!housesensor_db_device_first (DriverTable[i].name)) continue;
+
+        if (echttp_isdebug())
+            printf ("Starting driver %s\n", DriverTable[i].name);
+        DriverTable[i].initialize (DriverArgc, DriverArgv);
+        DriverActive[i] = 1;
+    }
+    DriverGeneration = housesensor_db_generation ();
+}
+
+void housesensor_driver_initialize (int argc, const char **argv) {
+
+    DriverArgc = argc;
+    DriverArgv = argv;
+    DriverActivate ();
+}
+
+void housesensor_driver_background (time_t now) {
+
+    int i;
+
+    if (housesensor_db_generation () != DriverGeneration) DriverActivate ();
+
+    for (i = 0; DriverTable[i].name; ++i) {
+        if (DriverActive[i]) DriverTable[i].background (now);
+    }
+}
+
+void housesensor_driver_metrics (void) {
+
+    int i;
+
+    for (i = 0; DriverTable[i].name; ++i) {
+        if (DriverActive[i] && DriverTable[i].metrics)
+            DriverTable[i].metrics ();
+    }
+}
+
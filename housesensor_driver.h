@@ -0,0 +1,33 @@
+/* housesensor - A simple home web server for measurements.
+ *
+ * Copyright 2019, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housesensor_driver.h - The table of sensor drivers.
+ */
+typedef struct {
+    const char *name; // The driver name, as used in the configuration.
+    void (*initialize) (int argc, const char **argv);
+    void (*background) (time_t now);
+    void (*metrics) (void);
+} housesensor_driver;
+
+void housesensor_driver_initialize (int argc, const char **argv);
+void housesensor_driver_background (time_t now);
+void housesensor_driver_metrics (void);
+
@@ -0,0 +1,276 @@
+/* housesensor - A simple home web server for measurements.
+ *
+ * Copyright 2019, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housesensor_hwmon.c - The Linux hardware monitoring interface.
+ *
+ * SYNOPSYS:
+ *
+ * void housesensor_hwmon_initialize (int argc, const char **argv);
+ *
+ *    Resolve the list of hwmon sensors.
+ *
+ * void housesensor_hwmon_background (time_t now);
+ *
+ *    Read all the sensors when the scan period has elapsed.
+ *
+ * void housesensor_hwmon_metrics (void);
+ *
+ *    Report the number of failed reads for each sensor.
+ *
+ * The device of a hwmon sensor is written as chip/attribute, where chip
+ * is either the name of the hwmon device (e.g. hwmon0) or the chip name
+ * listed in its name file (e.g. coretemp), and attribute is the name of
+ * the sensor (e.g. temp1, or temp1_input). The value is converted to the
+ * usual unit for this type of sensor (see HwmonTypes below).
+ *
+ * The hwmon files are read from the main thread, since reading them does
+ * not block for long. Each file is kept open, and read again at offset 0.
+ * All the sensors are read every hwmon.scan.period seconds (default: 10).
+ */
+
+#include <fcntl.h>
+#include <dirent.h>
+
+#include "housesensor.h"
+#include "housesensor_hwmon.h"
+#include "housesensor_db.h"
+#include "housesensor_metrics.h"
+
+
+// The hwmon values are integers, in the units listed in the Linux
+// documentation (sysfs-interface): e.g. millidegrees, millivolts or
+// microwatts.
+//
+typedef struct {
+    const char *prefix;
+    int decimals;
+    const char *unit;
+} HwmonType;
+
+static const HwmonType HwmonTypes[] = {
+    {"temp",     3, "°C"},
+    {"in",       3, "V"},
+    {"curr",     3, "A"},
+    {"power",    6, "W"},
+    {"energy",   6, "J"},
+    {"humidity", 3, "%"},
+    {"fan",      0, "RPM"},
+    {"pwm",      0, ""},
+    {0, 0, 0}
+};
+
+typedef struct {
+    const char *id;
+    int handle;
+    int fd;
+    const HwmonType *type;
+    long long errors;
+} HwmonDevice;
+
+static HwmonDevice *HwmonDevices = 0;
+static int HwmonDeviceCount = 0;
+static int HwmonDeviceSize = 0;
+
+static const char *HwmonRoot = "/sys/class/hwmon";
+static int HwmonPeriod = 10;
+static time_t HwmonDeadline = 0;
+static long HwmonGeneration = 0;
+
+
+static const HwmonType *HwmonTypeOf (const char *attribute) {
+
+    int i;
+
+    for (i = 0; HwmonTypes[i].prefix; ++i) {
+        int length = strlen (HwmonTypes[i].prefix);
+        if (strncmp (attribute, HwmonTypes[i].prefix, length)) continue;
+        if (attribute[length] >= '0' && attribute[length] <= '9')
+            return HwmonTypes + i;
+    }
+    return 0;
+}
+
+// Return 1 if the chip name listed in a hwmon device matches.
+//
+static int HwmonChipIs (const char *device, const char *chip) {
+
+    char name[1024];
+    char text[128];
+    int length;
+    int fd;
+
+    snprintf (name, sizeof(name), "%s/%s/name", HwmonRoot, device);
+    fd = open (name, O_RDONLY);
+    if (fd < 0) return 0;
+    length = read (fd, text, sizeof(text)-1);
+    close (fd);
+    if (length <= 0) return 0;
+    if (text[length-1] == '\n') length -= 1;
+    text[length] = 0;
+    return (strcmp (text, chip) == 0);
+}
+
+// Open the file for a chip/attribute sensor. Return -1 on failure.
+//
+static int HwmonOpen (const char *id) {
+
+    char path[1024];
+    char chip[128];
+    const char *attribute = strchr (id, '/');
+    const char *suffix;
+    struct dirent *de;
+    DIR *d;
+    int length;
+    int fd;
+
+    if (!attribute) return -1;
+    length = attribute - id;
+    if (length >= sizeof(chip)) return -1;
+    memcpy (chip, id, length);
+    chip[length] = 0;
+    attribute += 1;
+    suffix = strchr (attribute, '_') ? "" : "_input";
+
+    snprintf (path, sizeof(path),
+              "%s/%s/%s%s", HwmonRoot, chip, attribute, suffix);
+    fd = open (path, O_RDONLY|O_CLOEXEC);
+    if (fd >= 0) return fd;
+
+    d = opendir (HwmonRoot);
+    if (!d) return -1;
+    while ((de = readdir (d))) {
+        if (de->d_name[0] == '.') continue;
+        if (!HwmonChipIs (de->d_name, chip)) continue;
+        snprintf (path, sizeof(path),
+                  "%s/%s/%s%s", HwmonRoot, de->d_name, attribute, suffix);
+        fd = open (path, O_RDONLY|O_CLOEXEC);
+        if (fd >= 0) break;
+    }
+    closedir (d);
+    if (echttp_isdebug() && fd < 0) printf ("Cannot find hwmon %s\n", id);
+    return fd;
+}
+
+static int HwmonRead (HwmonDevice *device, long long *value) {
+
+    char data[32];
+    char *end;
+    int length;
+
+    if (device->fd < 0) {
+        device->fd = HwmonOpen (device->id);
+        if (device->fd < 0) return 0;
+    }
+    length = pread (device->fd, data, sizeof(data)-1, 0);
+    if (length <= 0) {
+        close (device->fd);
+        device->fd = -1;
+        return 0;
+    }
+    data[length] = 0;
+    *value = strtoll (data, &end, 10);
+    return (end > data);
+}
+
+static void HwmonResolve (void) {
+
+    const char *period = housesensor_db_option ("hwmon.scan.period");
+    const char *id;
+    int i;
+
+    HwmonPeriod = period ? atoi(period) : 10;
+    if (HwmonPeriod < 1) HwmonPeriod = 1;
+
+    for (i = 0; i < HwmonDeviceCount; ++i) {
+        if (HwmonDevices[i].fd >= 0) close (HwmonDevices[i].fd);
+    }
+    HwmonDeviceCount = 0;
+
+    for (id = housesensor_db_device_first("hwmon");
+         id; id = housesensor_db_device_next("hwmon")) {
+
+        HwmonDevice *device;
+        const char *attribute = strchr (id, '/');
+
+        if (HwmonDeviceCount >= HwmonDeviceSize) {
+            HwmonDeviceSize += 16;
+            HwmonDevices =
+                realloc (HwmonDevices, sizeof(HwmonDevice)*HwmonDeviceSize);
+            if (!HwmonDevices) {
+                fprintf (stderr,
+                         "No enough memory for %d devices\n", HwmonDeviceSize);
+                exit (1);
+            }
+        }
+        device = HwmonDevices + HwmonDeviceCount++;
+        device->id = id;
+        device->handle = housesensor_db_handle ("hwmon", id);
+        device->fd = -1;
+        device->type = attribute ? HwmonTypeOf (attribute + 1) : 0;
+        device->errors = 0;
+        if (!device->type)
+            fprintf (stderr, "unsupported hwmon sensor %s\n", id);
+    }
+    HwmonGeneration = housesensor_db_generation ();
+    HwmonDeadline = 0;
+}
+
+void housesensor_hwmon_initialize (int argc, const char **argv) {
+
+    const char *root = housesensor_db_option ("hwmon.root");
+
+    if (root) HwmonRoot = root;
+    HwmonResolve ();
+}
+
+void housesensor_hwmon_background (time_t now) {
+
+    int i;
+
+    if (housesensor_db_generation () != HwmonGeneration) HwmonResolve ();
+
+    if (now < HwmonDeadline) return;
+    HwmonDeadline = now + HwmonPeriod;
+
+    for (i = 0; i < HwmonDeviceCount; ++i) {
+        HwmonDevice *device = HwmonDevices + i;
+        long long value;
+        if (!device->type) continue;
+        if (!HwmonRead (device, &value)) {
+            device->errors += 1;
+            continue;
+        }
+        housesensor_db_set_number (device->handle, value,
+                                   device->type->decimals, device->type->unit);
+    }
+}
+
+void housesensor_hwmon_metrics (void) {
+
+    int i;
+
+    housesensor_metrics_declare ("housesensor_hwmon_read_errors_total",
+                                 "counter",
+                                 "Reads that failed to access the sensor.");
+    for (i = 0; i < HwmonDeviceCount; ++i)
+        housesensor_metrics_value ("device", HwmonDevices[i].id,
+                                   HwmonDevices[i].errors);
+}
+
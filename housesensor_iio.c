@@ -0,0 +1,720 @@
+/* housesensor - A simple home web server for measurements.
+ *
+ * Copyright 2019, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housesensor_iio.c - The Linux Industrial I/O interface.
+ *
+ * SYNOPSYS:
+ *
+ * void housesensor_iio_initialize (int argc, const char **argv);
+ *
+ *    Resolve the list of IIO channels and start the acquisition.
+ *
+ * void housesensor_iio_background (time_t now);
+ *
+ *    Record the average of the samples received for each channel, when
+ *    the recording period has elapsed. Restart the acquisition of the
+ *    devices that failed, after IIO_RETRY seconds.
+ *
+ * void housesensor_iio_metrics (void);
+ *
+ *    Report the number of samples received and of read errors for each
+ *    IIO device.
+ *
+ * The device of an IIO sensor is written as device/channel, where device
+ * is either the name of the IIO device (e.g. iio:device0) or the name
+ * listed in its name file (e.g. ads1015), and channel is the name of one
+ * of its scan elements (e.g. in_voltage0).
+ *
+ * The IIO devices are used in buffered mode: the channels are enabled as
+ * scan elements, the buffer is enabled, and the samples are read in
+ * batches from the device's character device (e.g. /dev/iio:device0) as
+ * they arrive, from the main loop. The raw samples are converted using
+ * the channel's offset and scale (giving e.g. millivolts) and averaged:
+ * the average is recorded every iio.period seconds (default: 1). This
+ * allows sampling an ADC at hundreds of Hz without recording hundreds of
+ * measurements per second.
+ *
+ * The acquisition of each IIO device can be tuned using the following
+ * options, where <device> is the device name as first used in the sensor
+ * lines:
+ *
+ *    iio.trigger.<device>    The name of the trigger to use, if any.
+ *    iio.frequency.<device>  The sampling frequency, in Hz.
+ *    iio.buffer.<device>     The length of the kernel buffer, in samples.
+ *    iio.watermark.<device>  The number of samples to wait for before
+ *                            the data is delivered.
+ *
+ * When the configuration is reloaded, the acquisition is restarted only
+ * if the list of IIO sensors or their options changed.
+ */
+
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+
+#include "echttp_libc.h"
+
+#include "housesensor.h"
+#include "housesensor_iio.h"
+#include "housesensor_db.h"
+#include "housesensor_metrics.h"
+
+
+typedef struct {
+    char name[32];      // The sysfs name, e.g. iio:device0.
+    char alias[128];    // The name used in the configuration.
+    char settings[512]; // The options in use, to detect changes.
+    int fd;
+    int scansize;       // The size of one sample of all enabled elements.
+    unsigned char *data;
+    int length;
+    int size;
+    long long samples;
+    long long errors;
+    time_t retry;       // When to restart the acquisition, 0 if running.
+} IioDevice;
+
+typedef struct {
+    const char *id;
+    int handle;
+    int device;         // Index in IioDevices.
+    char element[64];
+
+    // How to find and decode the channel in a sample.
+    //
+    int offset;
+    int bytes;          // 0 if the channel is not in the samples.
+    int bits;
+    int shift;
+    char issigned;
+    char bigendian;
+    double base;
+    double scale;
+
+    double sum;
+    int count;
+} IioChannel;
+
+// One scan element, as listed by the driver. This is used to compute
+// where each channel is located in a sample.
+//
+typedef struct {
+    char name[64];
+    int index;
+    int bytes;
+    int length;
+    int bits;
+    int shift;
+    char issigned;
+    char bigendian;
+} IioElement;
+
+static IioDevice *IioDevices = 0;
+static int IioDeviceCount = 0;
+static int IioDeviceSize = 0;
+
+static IioChannel *IioChannels = 0;
+static int IioChannelCount = 0;
+static int IioChannelSize = 0;
+
+static const char *IioRoot = "/sys/bus/iio/devices";
+static const char *IioDev = "/dev";
+static int IioPeriod = 1;
+static time_t IioDeadline = 0;
+static long IioGeneration = 0;
+
+#define IIO_BATCH 64 // Samples read at once.
+#define IIO_RETRY 60 // Seconds before restarting a failed device.
+
+
+static int IioRead (const IioDevice *d, const char *attribute,
+                    char *value, int size) {
+
+    char path[1024];
+    int length;
+    int fd;
+
+    snprintf (path, sizeof(path), "%s/%s/%s", IioRoot, d->name, attribute);
+    fd = open (path, O_RDONLY);
+    if (fd < 0) return 0;
+    length = read (fd, value, size-1);
+    close (fd);
+    if (length <= 0) return 0;
+    if (value[length-1] == '\n') length -= 1;
+    value[length] = 0;
+    return 1;
+}
+
+static int IioWrite (const IioDevice *d,
+                     const char *attribute, const char *value) {
+
+    char path[1024];
+    int length = strlen(value);
+    int fd;
+
+    snprintf (path, sizeof(path), "%s/%s/%s", IioRoot, d->name, attribute);
+    fd = open (path, O_WRONLY);
+    if (fd < 0) return 0;
+    if (write (fd, value, length) != length) {
+        if (echttp_isdebug())
+            printf ("Cannot write %s to %s: %s\n",
+                    value, path, strerror(errno));
+        close (fd);
+        return 0;
+    }
+    close (fd);
+    return 1;
+}
+
+static const char *IioOption (const char *option, const char *alias) {
+
+    char name[256];
+
+    snprintf (name, sizeof(name), "iio.%s.%s", option, alias);
+    return housesensor_db_option (name);
+}
+
+static void IioSettings (const char *alias, char *settings, int size) {
+
+    static const char *options[] = {"trigger", "frequency",
+                                    "buffer", "watermark", 0};
+    int length = 0;
+    int i;
+
+    settings[0] = 0;
+    for (i = 0; options[i]; ++i) {
+        const char *value = IioOption (options[i], alias);
+        length += snprintf (settings + length, size - length,
+                            "%s|", value ? value : "");
+        if (length >= size) break;
+    }
+}
+
+// Find the sysfs name of a device, which may be given by its name.
+//
+static int IioResolveName (const char *alias, char *name, int size) {
+
+    char path[1024];
+    struct dirent *de;
+    DIR *d;
+    IioDevice probe;
+    char text[128];
+
+    snprintf (path, sizeof(path), "%s/%s", IioRoot, alias);
+    if (access (path, F_OK) == 0) {
+        strtcpy (name, alias, size);
+        return 1;
+    }
+    d = opendir (IioRoot);
+    if (!d) return 0;
+    while ((de = readdir (d))) {
+        if (strncmp (de->d_name, "iio:device", 10)) continue;
+        strtcpy (probe.name, de->d_name, sizeof(probe.name));
+        if (!IioRead (&probe, "name", text, sizeof(text))) continue;
+        if (strcmp (text, alias)) continue;
+        strtcpy (name, de->d_name, size);
+        closedir (d);
+        return 1;
+    }
+    closedir (d);
+    return 0;
+}
+
+// Decode a type, e.g. "le:s12/16>>4" or "le:s12/16X2>>4".
+//
+static int IioDecodeType (const char *text, IioElement *e) {
+
+    char endian[3];
+    char sign;
+    int storage;
+    int repeat = 1;
+
+    if (sscanf (text, "%2s:%c%d/%dX%d>>%d", endian, &sign,
+                &e->bits, &storage, &repeat, &e->shift) != 6) {
+        repeat = 1;
+        if (sscanf (text, "%2s:%c%d/%d>>%d", endian, &sign,
+                    &e->bits, &storage, &e->shift) != 5) return 0;
+    }
+    if (storage <= 0 || storage > 64 || storage % 8) return 0;
+    if (e->bits <= 0 || e->bits > storage) return 0;
+    e->bytes = storage / 8;
+    e->length = e->bytes * (repeat > 0 ? repeat : 1);
+    e->issigned = (sign == 's' || sign == 'S');
+    e->bigendian = (strcmp (endian, "be") == 0);
+    return 1;
+}
+
+static int IioCompareElements (const void *a, const void *b) {
+    return ((const IioElement *)a)->index - ((const IioElement *)b)->index;
+}
+
+// Read the scale and offset of a channel, either specific to this
+// channel (e.g. in_voltage0_scale) or shared by all the channels of
+// the same type (e.g. in_voltage_scale).
+//
+static double IioChannelAttribute (const IioDevice *d, const char *element,
+                                   const char *attribute, double fallback) {
+
+    char name[256];
+    char text[64];
+    int length = strlen(element);
+
+    snprintf (name, sizeof(name), "%s_%s", element, attribute);
+    if (IioRead (d, name, text, sizeof(text))) return atof(text);
+
+    while (length > 0 && element[length-1] >= '0' && element[length-1] <= '9')
+        length -= 1;
+    snprintf (name, sizeof(name), "%.*s_%s", length, element, attribute);
+    if (IioRead (d, name, text, sizeof(text))) return atof(text);
+    return fallback;
+}
+
+// Compute the layout of a sample: the elements are stored in the order
+// of their index, each aligned on its own size, and the sample size is
+// aligned on the size of the largest element.
+//
+static void IioLayout (IioDevice *d, int device) {
+
+    char path[1024];
+    char text[64];
+    struct dirent *de;
+    IioElement *elements = 0;
+    int count = 0;
+    int size = 0;
+    int offset = 0;
+    int largest = 1;
+    int i, j;
+    DIR *dir;
+
+    snprintf (path, sizeof(path), "%s/%s/scan_elements", IioRoot, d->name);
+    dir = opendir (path);
+    if (!dir) return;
+    while ((de = readdir (dir))) {
+        char attribute[320];
+        IioElement *e;
+        int length = strlen (de->d_name);
+
+        if (length <= 3 || strcmp (de->d_name + length - 3, "_en")) continue;
+        snprintf (attribute, sizeof(attribute),
+                  "scan_elements/%s", de->d_name);
+        if (!IioRead (d, attribute, text, sizeof(text))) continue;
+        if (atoi(text) != 1) continue;
+
+        if (count >= size) {
+            size += 16;
+            elements = realloc (elements, size * sizeof(IioElement));
+            if (!elements) {
+                fprintf (stderr, "No enough memory for %d elements\n", size);
+                exit (1);
+            }
+        }
+        e = elements + count;
+        snprintf (e->name, sizeof(e->name), "%.*s", length - 3, de->d_name);
+
+        snprintf (attribute, sizeof(attribute),
+                  "scan_elements/%s_index", e->name);
+        if (!IioRead (d, attribute, text, sizeof(text))) continue;
+        e->index = atoi(text);
+        snprintf (attribute, sizeof(attribute),
+                  "scan_elements/%s_type", e->name);
+        if (!IioRead (d, attribute, text, sizeof(text))) continue;
+        if (!IioDecodeType (text, e)) {
+            fprintf (stderr, "Invalid IIO type %s for %s\n", text, e->name);
+            continue;
+        }
+        count += 1;
+    }
+    closedir (dir);
+
+    qsort (elements, count, sizeof(IioElement), IioCompareElements);
+
+    for (i = 0; i < count; ++i) {
+        IioElement *e = elements + i;
+        if (offset % e->length) offset += e->length - (offset % e->length);
+        for (j = 0; j < IioChannelCount; ++j) {
+            IioChannel *c = IioChannels + j;
+            if (c->device != device || strcmp (c->element, e->name)) continue;
+            c->offset = offset;
+            c->bytes = e->bytes;
+            c->bits = e->bits;
+            c->shift = e->shift;
+            c->issigned = e->issigned;
+            c->bigendian = e->bigendian;
+        }
+        offset += e->length;
+        if (e->length > largest) largest = e->length;
+    }
+    if (offset % largest) offset += largest - (offset % largest);
+    d->scansize = offset;
+    free (elements);
+}
+
+static void IioReceive (int fd, int mode);
+
+static void IioStart (IioDevice *d, int device) {
+
+    char attribute[256];
+    char path[1024];
+    const char *value;
+    int i;
+
+    d->retry = 0;
+    IioWrite (d, "buffer/enable", "0");
+
+    for (i = 0; i < IioChannelCount; ++i) {
+        IioChannel *c = IioChannels + i;
+        if (c->device != device) continue;
+        snprintf (attribute, sizeof(attribute),
+                  "scan_elements/%s_en", c->element);
+        if (!IioWrite (d, attribute, "1"))
+            fprintf (stderr, "Cannot enable IIO channel %s\n", c->id);
+        c->scale = IioChannelAttribute (d, c->element, "scale", 1.0);
+        c->base = IioChannelAttribute (d, c->element, "offset", 0.0);
+    }
+
+    value = IioOption ("trigger", d->alias);
+    if (value) IioWrite (d, "trigger/current_trigger", value);
+    value = IioOption ("frequency", d->alias);
+    if (value) IioWrite (d, "sampling_frequency", value);
+    value = IioOption ("buffer", d->alias);
+    if (value) IioWrite (d, "buffer/length", value);
+    value = IioOption ("watermark", d->alias);
+    if (value) IioWrite (d, "buffer/watermark", value);
+
+    IioLayout (d, device);
+    if (d->scansize <= 0) {
+        fprintf (stderr, "No IIO channel enabled for %s\n", d->alias);
+        return;
+    }
+    d->size = d->scansize * IIO_BATCH;
+    d->data = malloc (d->size);
+    if (!d->data) {
+        fprintf (stderr, "No enough memory for IIO device %s\n", d->alias);
+        exit (1);
+    }
+    d->length = 0;
+
+    // From here on, a failure may be transient (e.g. the device is busy):
+    // the acquisition will be retried later.
+    //
+    d->retry = time(0) + IIO_RETRY;
+
+    if (!IioWrite (d, "buffer/enable", "1")) {
+        fprintf (stderr, "Cannot enable the IIO buffer for %s\n", d->alias);
+        return;
+    }
+    snprintf (path, sizeof(path), "%s/%s", IioDev, d->name);
+    d->fd = open (path, O_RDONLY|O_NONBLOCK|O_CLOEXEC);
+    if (d->fd < 0) {
+        fprintf (stderr, "Cannot open %s: %s\n", path, strerror(errno));
+        return;
+    }
+    d->retry = 0;
+    echttp_listen (d->fd, 1, IioReceive, 0);
+    if (echttp_isdebug())
+        printf ("Started IIO device %s (%s), %d bytes per sample\n",
+                d->alias, d->name, d->scansize);
+}
+
+static void IioStop (IioDevice *d, int device) {
+
+    char attribute[256];
+    int i;
+
+    if (d->fd >= 0) {
+        echttp_forget (d->fd);
+        close (d->fd);
+        d->fd = -1;
+    }
+    IioWrite (d, "buffer/enable", "0");
+
+    for (i = 0; i < IioChannelCount; ++i) {
+        IioChannel *c = IioChannels + i;
+        if (c->device != device) continue;
+        snprintf (attribute, sizeof(attribute),
+                  "scan_elements/%s_en", c->element);
+        IioWrite (d, attribute, "0");
+    }
+    free (d->data);
+    d->data = 0;
+}
+
+static long long IioRaw (const IioChannel *c, const unsigned char *sample) {
+
+    const unsigned char *p = sample + c->offset;
+    unsigned long long raw = 0;
+    int i;
+
+    if (c->bigendian) {
+        for (i = 0; i < c->bytes; ++i) raw = (raw << 8) | p[i];
+    } else {
+        for (i = c->bytes - 1; i >= 0; --i) raw = (raw << 8) | p[i];
+    }
+    raw >>= c->shift;
+    if (c->bits < 64) {
+        unsigned long long mask = (1ULL << c->bits) - 1;
+        raw &= mask;
+        if (c->issigned && (raw & (1ULL << (c->bits - 1)))) raw |= ~mask;
+    }
+    return (long long)raw;
+}
+
+static void IioReceive (int fd, int mode) {
+
+    IioDevice *d;
+    int device;
+    int length;
+    int offset;
+    int i;
+
+    for (device = 0; device < IioDeviceCount; ++device) {
+        if (IioDevices[device].fd == fd) break;
+    }
+    if (device >= IioDeviceCount) return;
+    d = IioDevices + device;
+
+    for (;;) {
+        length = read (fd, d->data + d->length, d->size - d->length);
+        if (length < 0 && (errno == EAGAIN || errno == EINTR)) break;
+        if (length <= 0) {
+            // The device is gone or failed: stop listening to it, or else
+            // the main loop would keep waking up on it. The acquisition
+            // is restarted later from the background.
+            //
+            fprintf (stderr, "IIO device %s failed: %s\n", d->alias,
+                     length ? strerror(errno) : "end of file");
+            d->errors += 1;
+            IioStop (d, device);
+            d->retry = time(0) + IIO_RETRY;
+            break;
+        }
+        d->length += length;
+
+        for (offset = 0;
+             offset + d->scansize <= d->length; offset += d->scansize) {
+            for (i = 0; i < IioChannelCount; ++i) {
+                IioChannel *c = IioChannels + i;
+                if (c->device != device || !c->bytes) continue;
+                c->sum += (IioRaw (c, d->data + offset) + c->base) * c->scale;
+                c->count += 1;
+            }
+            d->samples += 1;
+        }
+        if (offset < d->length)
+            memmove (d->data, d->data + offset, d->length - offset);
+        d->length -= offset;
+    }
+}
+
+static void IioStopAll (void) {
+
+    int i;
+
+    for (i = 0; i < IioDeviceCount; ++i) IioStop (IioDevices + i, i);
+    IioDeviceCount = 0;
+    IioChannelCount = 0;
+}
+
+// The same device may be named differently in different sensor lines:
+// the first name used is the one for the options and metrics.
+//
+static int IioAddDevice (const char *alias, int length) {
+
+    IioDevice *d;
+    char text[128];
+    char name[32];
+    int i;
+
+    snprintf (text, sizeof(text), "%.*s", length, alias);
+    if (!IioResolveName (text, name, sizeof(name))) {
+        fprintf (stderr, "Cannot find IIO device %s\n", text);
+        return -1;
+    }
+    for (i = 0; i < IioDeviceCount; ++i) {
+        if (!strcmp (IioDevices[i].name, name)) return i;
+    }
+
+    if (IioDeviceCount >= IioDeviceSize) {
+        IioDeviceSize += 4;
+        IioDevices = realloc (IioDevices, sizeof(IioDevice)*IioDeviceSize);
+        if (!IioDevices) {
+            fprintf (stderr,
+                     "No enough memory for %d devices\n", IioDeviceSize);
+            exit (1);
+        }
+    }
+    d = IioDevices + IioDeviceCount;
+    memset (d, 0, sizeof(IioDevice));
+    d->fd = -1;
+    strtcpy (d->name, name, sizeof(d->name));
+    strtcpy (d->alias, text, sizeof(d->alias));
+    IioSettings (d->alias, d->settings, sizeof(d->settings));
+    return IioDeviceCount++;
+}
+
+// Return 1 if the IIO sensor is valid and its device exists. The sysfs
+// name of the device is returned in name.
+//
+static int IioChannelDevice (const char *id, char *name, int size) {
+
+    char text[128];
+    const char *element = strchr (id, '/');
+
+    if (!element) return 0;
+    snprintf (text, sizeof(text), "%.*s", (int)(element - id), id);
+    return IioResolveName (text, name, size);
+}
+
+// Return 1 if the IIO sensors and their options did not change. The
+// sensors that cannot be used are ignored, as IioResolve() does.
+//
+static int IioUnchanged (void) {
+
+    char settings[512];
+    char name[32];
+    const char *id;
+    int i = 0;
+
+    for (id = housesensor_db_device_first("iio");
+         id; id = housesensor_db_device_next("iio")) {
+        if (!IioChannelDevice (id, name, sizeof(name))) continue; // Ignored.
+        if (i >= IioChannelCount || strcmp (id, IioChannels[i].id)) return 0;
+        if (strcmp (name, IioDevices[IioChannels[i].device].name)) return 0;
+        i += 1;
+    }
+    if (i != IioChannelCount) return 0;
+
+    for (i = 0; i < IioDeviceCount; ++i) {
+        IioSettings (IioDevices[i].alias, settings, sizeof(settings));
+        if (strcmp (settings, IioDevices[i].settings)) return 0;
+    }
+    return 1;
+}
+
+static void IioResolve (void) {
+
+    const char *period = housesensor_db_option ("iio.period");
+    const char *id;
+    int i;
+
+    IioPeriod = period ? atoi(period) : 1;
+    if (IioPeriod < 1) IioPeriod = 1;
+    IioGeneration = housesensor_db_generation ();
+
+    if (IioChannelCount > 0 && IioUnchanged ()) {
+        for (i = 0; i < IioChannelCount; ++i)
+            IioChannels[i].handle =
+                housesensor_db_handle ("iio", IioChannels[i].id);
+        return;
+    }
+    IioStopAll ();
+
+    for (id = housesensor_db_device_first("iio");
+         id; id = housesensor_db_device_next("iio")) {
+
+        IioChannel *c;
+        const char *element = strchr (id, '/');
+        int device;
+
+        if (!element) {
+            fprintf (stderr, "Invalid IIO sensor %s\n", id);
+            continue;
+        }
+        device = IioAddDevice (id, element - id);
+        if (device < 0) continue;
+
+        if (IioChannelCount >= IioChannelSize) {
+            IioChannelSize += 16;
+            IioChannels =
+                realloc (IioChannels, sizeof(IioChannel)*IioChannelSize);
+            if (!IioChannels) {
+                fprintf (stderr,
+                         "No enough memory for %d channels\n", IioChannelSize);
+                exit (1);
+            }
+        }
+        c = IioChannels + IioChannelCount++;
+        memset (c, 0, sizeof(IioChannel));
+        c->id = id;
+        c->handle = housesensor_db_handle ("iio", id);
+        c->device = device;
+        strtcpy (c->element, element + 1, sizeof(c->element));
+    }
+
+    for (i = 0; i < IioDeviceCount; ++i) IioStart (IioDevices + i, i);
+}
+
+void housesensor_iio_initialize (int argc, const char **argv) {
+
+    const char *root = housesensor_db_option ("iio.root");
+    const char *dev = housesensor_db_option ("iio.dev");
+
+    if (root) IioRoot = root;
+    if (dev) IioDev = dev;
+    IioResolve ();
+}
+
+void housesensor_iio_background (time_t now) {
+
+    int i;
+
+    if (housesensor_db_generation () != IioGeneration) IioResolve ();
+
+    for (i = 0; i < IioDeviceCount; ++i) {
+        IioDevice *d = IioDevices + i;
+        if (d->retry && now >= d->retry) {
+            IioStop (d, i);
+            IioStart (d, i);
+        }
+    }
+
+    if (now < IioDeadline) return;
+    IioDeadline = now + IioPeriod;
+
+    for (i = 0; i < IioChannelCount; ++i) {
+        IioChannel *c = IioChannels + i;
+        double average;
+        if (!c->count) continue;
+        average = (c->sum / c->count) * 1000.0;
+        average += (average < 0) ? -0.5 : 0.5;
+        housesensor_db_set_number (c->handle, (long long)average, 3, 0);
+        c->sum = 0;
+        c->count = 0;
+    }
+}
+
+void housesensor_iio_metrics (void) {
+
+    int i;
+
+    housesensor_metrics_declare ("housesensor_iio_samples_total", "counter",
+                                 "Samples received from the IIO device.");
+    for (i = 0; i < IioDeviceCount; ++i)
+        housesensor_metrics_value ("device", IioDevices[i].alias,
+                                   IioDevices[i].samples);
+
+    housesensor_metrics_declare ("housesensor_iio_read_errors_total",
+                                 "counter",
+                                 "Reads that failed on the IIO device.");
+    for (i = 0; i < IioDeviceCount; ++i)
+        housesensor_metrics_value ("device", IioDevices[i].alias,
+                                   IioDevices[i].errors);
+}
+
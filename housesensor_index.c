@@ -0,0 +1,447 @@
+/* housesensor - A simple home web server for measurements.
+ *
+ * Copyright 2019, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housesensor_index.c - The time index of the daily CSV archives.
+ *
+ * SYNOPSIS:
+ *
+ * int housesensor_index_write (const char *csv);
+ *
+ *    Write the index for the specified CSV archive. The index file has
+ *    the same name as the archive, with the .idx extension. Return 1 on
+ *    success, 0 on failure.
+ *
+ * int housesensor_index_select (const char *csv, long size,
+ *                               time_t from, time_t to,
+ *                               const char *location, const char *name,
+ *                               housesensor_index_listener *listener,
+ *                               void *context);
+ *
+ *    Call the listener for each region of the CSV archive that may hold
+ *    measurements between from and to for the sensors that match the
+ *    location and name (a null location or name matches all). Adjacent
+ *    regions are merged. Return 0 if there is no valid index for this
+ *    archive (the size of the archive is checked, and any line of the
+ *    index that does not parse invalidates it): the whole archive must
+ *    then be read. The listener is never called in that case.
+ *
+ * The archive is divided in blocks of consecutive lines, a new block
+ * starting every INDEX_INTERVAL seconds of measurements. The index is
+ * a text file made of:
+ * - one header line: I,<archive size>,<interval>
+ * - one line per sensor present in the archive: S,<location>,<name>
+ * - one line per block: B,<offset>,<first time>,<last time>,<sensors>
+ *   where the first and last time are the oldest and newest measurements
+ *   in the block and sensors is a hexadecimal bitmap of the sensors
+ *   present in the block (sensor 0 is the lowest bit of the first digit).
+ *   A block ends where the next one starts.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+
+#include "housesensor.h"
+#include "housesensor_index.h"
+
+
+#define INDEX_INTERVAL 300
+
+typedef struct {
+    char *location;
+    char *name;
+} IndexSensor;
+
+typedef struct {
+    long offset;
+    time_t first;
+    time_t last;
+    unsigned char *sensors; // One nibble per byte: 4 sensors.
+} IndexBlock;
+
+static IndexSensor *IndexSensors = 0;
+static int IndexSensorCount = 0;
+static int IndexSensorSize = 0;
+
+static IndexBlock *IndexBlocks = 0;
+static int IndexBlockCount = 0;
+static int IndexBlockSize = 0;
+
+static int IndexNibbles = 0; // Size of the bitmap of each block.
+
+
+static void IndexReset (void) {
+
+    int i;
+
+    for (i = 0; i < IndexSensorCount; ++i) {
+        free (IndexSensors[i].location);
+        free (IndexSensors[i].name);
+    }
+    for (i = 0; i < IndexBlockCount; ++i) free (IndexBlocks[i].sensors);
+    IndexSensorCount = 0;
+    IndexBlockCount = 0;
+}
+
+static void *IndexGrow (void *table, int *size, int item) {
+
+    *size = *size ? *size * 2 : 64;
+    table = realloc (table, *size * item);
+    if (!table) {
+        fprintf (stderr, "No enough memory for %d index items\n", *size);
+        exit (1);
+    }
+    return table;
+}
+
+static int IndexSensorFind (const char *location, int locationlength,
+                            const char *name, int namelength) {
+
+    int i;
+
+    // The lines for the same sensor tend to come in the same order in
+    // each block: start with the sensor after the one found previously.
+    //
+    static int Hint = 0;
+
+    for (i = 0; i < IndexSensorCount; ++i) {
+        int s = (Hint + i) % IndexSensorCount;
+        IndexSensor *sensor = IndexSensors + s;
+        if (strncmp (sensor->location, location, locationlength) ||
+            sensor->location[locationlength]) continue;
+        if (strncmp (sensor->name, name, namelength) ||
+            sensor->name[namelength]) continue;
+        Hint = s + 1;
+        return s;
+    }
+
+    if (IndexSensorCount >= IndexSensorSize)
+        IndexSensors =
+            IndexGrow (IndexSensors, &IndexSensorSize, sizeof(IndexSensor));
+    IndexSensors[IndexSensorCount].location = strndup (location, locationlength);
+    IndexSensors[IndexSensorCount].name = strndup (name, namelength);
+    return IndexSensorCount++;
+}
+
+static IndexBlock *IndexBlockNew (long offset, time_t timestamp) {
+
+    IndexBlock *block;
+
+    if (IndexBlockCount >= IndexBlockSize)
+        IndexBlocks = IndexGrow (IndexBlocks, &IndexBlockSize, sizeof(IndexBlock));
+    block = IndexBlocks + IndexBlockCount++;
+    block->offset = offset;
+    block->first = block->last = timestamp;
+    block->sensors = calloc (IndexNibbles, 1);
+    return block;
+}
+
+static void IndexBlockAdd (IndexBlock *block, int sensor) {
+
+    int nibble = sensor / 4;
+
+    if (nibble >= IndexNibbles) {
+        // The bitmaps are grown for all blocks, including the closed
+        // ones, to keep them the same size.
+        //
+        int size = IndexNibbles ? IndexNibbles * 2 : 16;
+        int i;
+        while (nibble >= size) size *= 2;
+        for (i = 0; i < IndexBlockCount; ++i) {
+            IndexBlocks[i].sensors = realloc (IndexBlocks[i].sensors, size);
+            if (!IndexBlocks[i].sensors) {
+                fprintf (stderr, "No enough memory for the index\n");
+                exit (1);
+            }
+            memset (IndexBlocks[i].sensors + IndexNibbles,
+                    0, size - IndexNibbles);
+        }
+        IndexNibbles = size;
+    }
+    block->sensors[nibble] |= (1 << (sensor % 4));
+}
+
+static void IndexScan (const char *data, long size) {
+
+    const char *line = data;
+    const char *end = data + size;
+    IndexBlock *block = 0;
+    time_t blockend = 0;
+
+    while (line < end) {
+        const char *eol = memchr (line, '\n', end - line);
+        const char *p = line;
+        const char *location;
+        const char *name;
+        time_t timestamp = 0;
+        long offset = line - data;
+
+        if (!eol) eol = end;
+        line = eol + 1;
+
+        while (p < eol && *p >= '0' && *p <= '9')
+            timestamp = (timestamp * 10) + (*(p++) - '0');
+        if (p >= eol || *p != ',') continue;
+
+        location = ++p;
+        p = memchr (p, ',', eol - p);
+        if (!p) continue;
+        name = ++p;
+        p = memchr (p, ',', eol - p);
+        if (!p) continue;
+
+        // A new block also starts if the clock went back: the blocks
+        // then remain small enough, even if not in time order.
+        //
+        if (!block || timestamp >= blockend ||
+            timestamp < blockend - 2 * INDEX_INTERVAL) {
+            block = IndexBlockNew (offset, timestamp);
+            blockend = timestamp - (timestamp % INDEX_INTERVAL) + INDEX_INTERVAL;
+        }
+        if (timestamp < block->first) block->first = timestamp;
+        if (timestamp > block->last) block->last = timestamp;
+        IndexBlockAdd (block,
+                       IndexSensorFind (location, name - location - 1,
+                                        name, p - name));
+    }
+}
+
+static void IndexName (const char *csv, char *name, int size) {
+
+    int length = strlen(csv);
+
+    if (length > 4 && !strcmp (csv + length - 4, ".csv")) length -= 4;
+    snprintf (name, size, "%*.*s.idx", length, length, csv);
+}
+
+int housesensor_index_write (const char *csv) {
+
+    static const char hex[] = "0123456789abcdef";
+
+    char name[256];
+    char temporary[sizeof(name)+8];
+    struct stat info;
+    void *data;
+    FILE *out;
+    int ok = 1;
+    int i, j;
+    int fd = open (csv, O_RDONLY);
+
+    if (fd < 0) return 0;
+    if (fstat (fd, &info) < 0 || info.st_size <= 0) {
+        close (fd);
+        return 0;
+    }
+    data = mmap (0, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close (fd);
+    if (data == MAP_FAILED) return 0;
+
+    madvise (data, info.st_size, MADV_SEQUENTIAL);
+    IndexScan ((const char *)data, info.st_size);
+    munmap (data, info.st_size);
+
+    IndexName (csv, name, sizeof(name));
+    snprintf (temporary, sizeof(temporary), "%s.tmp", name);
+    out = fopen (temporary, "w");
+    if (!out) {
+        IndexReset ();
+        return 0;
+    }
+    fprintf (out, "I,%lld,%d\n", (long long)info.st_size, INDEX_INTERVAL);
+    for (i = 0; i < IndexSensorCount; ++i) {
+        fprintf (out, "S,%s,%s\n",
+                 IndexSensors[i].location, IndexSensors[i].name);
+    }
+    for (i = 0; i < IndexBlockCount; ++i) {
+        IndexBlock *block = IndexBlocks + i;
+        int last = IndexNibbles - 1;
+        while (last > 0 && !block->sensors[last]) last -= 1;
+        fprintf (out, "B,%ld,%lld,%lld,",
+                 block->offset, (long long)block->first, (long long)block->last);
+        for (j = 0; j <= last; ++j) fputc (hex[block->sensors[j]], out);
+        fputc ('\n', out);
+    }
+    if (fclose (out)) ok = 0;
+    if (ok) ok = (rename (temporary, name) == 0);
+    if (!ok) unlink (temporary);
+
+    IndexReset ();
+    return ok;
+}
+
+static int IndexHexadecimal (char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return -1;
+}
+
+typedef struct {
+    long offset;
+    long length;
+} IndexRegion;
+
+static IndexRegion *IndexRegions = 0;
+static int IndexRegionSize = 0;
+static int IndexRegionCount = 0;
+
+static void IndexRegionAdd (long offset, long length) {
+    if (IndexRegionCount >= IndexRegionSize)
+        IndexRegions = IndexGrow (IndexRegions,
+                                  &IndexRegionSize, sizeof(IndexRegion));
+    IndexRegions[IndexRegionCount].offset = offset;
+    IndexRegions[IndexRegionCount].length = length;
+    IndexRegionCount += 1;
+}
+
+// Parse the index file and collect the regions to read. Any line that
+// does not parse invalidates the whole index: a partial selection would
+// silently miss measurements.
+//
+static int IndexParse (FILE *in, long size,
+                       time_t from, time_t to,
+                       const char *location, const char *name) {
+
+    char *line = 0;
+    size_t linesize = 0;
+    ssize_t length;
+    unsigned char *mask = 0;
+    int masksize = 0;
+    int sensor = 0;
+    int blocks = 0;
+    long previous = 0;
+    long start = -1; // Start of the region being selected.
+    int ok = 0;
+
+    IndexRegionCount = 0;
+
+    while ((length = getline (&line, &linesize, in)) > 0) {
+
+        int consumed = 0;
+
+        if (line[length-1] != '\n') break; // Truncated file.
+        line[--length] = 0;
+
+        if (!ok) {
+            long long indexed;
+            int interval;
+            if (sscanf (line, "I,%lld,%d%n",
+                        &indexed, &interval, &consumed) < 2) break;
+            if (consumed != length || indexed != size) break; // Stale?
+            ok = 1;
+
+        } else if (line[0] == 'S' && line[1] == ',' && !blocks) {
+            char *sensorname = strchr (line + 2, ',');
+            if (!sensorname) {
+                ok = 0;
+                break;
+            }
+            *(sensorname++) = 0;
+            if (sensor / 4 >= masksize) {
+                int size = masksize ? masksize * 2 : 16;
+                mask = realloc (mask, size);
+                if (!mask) {
+                    fprintf (stderr, "No enough memory for index mask\n");
+                    exit (1);
+                }
+                memset (mask + masksize, 0, size - masksize);
+                masksize = size;
+            }
+            if ((!location || !strcmp (location, line + 2)) &&
+                (!name || !strcmp (name, sensorname)))
+                mask[sensor / 4] |= (1 << (sensor % 4));
+            sensor += 1;
+
+        } else if (line[0] == 'B') {
+            long offset;
+            long long first, last;
+            int selected = 0;
+            char *p;
+            int i;
+
+            blocks += 1;
+            if (sscanf (line, "B,%ld,%lld,%lld,%n",
+                        &offset, &first, &last, &consumed) < 3 || !consumed) {
+                ok = 0;
+                break;
+            }
+            if (offset < previous || offset > size) {
+                ok = 0;
+                break;
+            }
+            previous = offset;
+            p = line + consumed;
+            if (length - consumed > (sensor + 3) / 4) {
+                ok = 0; // More sensors than declared.
+                break;
+            }
+            for (i = 0; p[i]; ++i) {
+                int digit = IndexHexadecimal(p[i]);
+                if (digit < 0) break;
+                if (digit & mask[i]) selected = 1;
+            }
+            if (p[i]) {
+                ok = 0;
+                break;
+            }
+            if (last < from || first >= to) selected = 0;
+
+            if (selected) {
+                if (start < 0) start = offset;
+            } else if (start >= 0) {
+                IndexRegionAdd (start, offset - start);
+                start = -1;
+            }
+        } else {
+            ok = 0;
+            break;
+        }
+    }
+    if (length > 0) ok = 0; // Stopped before the end of the file.
+    free (line);
+    free (mask);
+
+    if (ok && start >= 0) IndexRegionAdd (start, size - start);
+    return ok;
+}
+
+int housesensor_index_select (const char *csv, long size,
+                              time_t from, time_t to,
+                              const char *location, const char *name,
+                              housesensor_index_listener *listener,
+                              void *context) {
+
+    char index[256];
+    int ok;
+    int i;
+    FILE *in;
+
+    IndexName (csv, index, sizeof(index));
+    in = fopen (index, "r");
+    if (!in) return 0;
+
+    ok = IndexParse (in, size, from, to, location, name);
+    fclose (in);
+    if (!ok) return 0;
+
+    for (i = 0; i < IndexRegionCount; ++i)
+        listener (context, IndexRegions[i].offset, IndexRegions[i].length);
+    return 1;
+}
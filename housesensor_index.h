@@ -0,0 +1,33 @@
+/* housesensor - A simple home web server for measurements.
+ *
+ * Copyright 2019, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housesensor_index.h - The time index of the daily CSV archives.
+ */
+int housesensor_index_write (const char *csv);
+
+typedef void housesensor_index_listener (void *context,
+                                         long offset, long length);
+
+int housesensor_index_select (const char *csv, long size,
+                              time_t from, time_t to,
+                              const char *location, const char *name,
+                              housesensor_index_listener *listener,
+                              void *context);
+
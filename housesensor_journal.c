@@ -0,0 +1,240 @@
+/* housesensor - A simple home web server for measurements.
+ *
+ * Copyright 2019, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housesensor_journal.c - The journal of measurements (CSV log).
+ *
+ * SYNOPSIS:
+ *
+ * void housesensor_journal_initialize (const char *name);
+ *
+ *    Set the name of the journal file. Must be called once.
+ *
+ * void housesensor_journal_add (const char *line, int length);
+ *
+ *    Add one line to the journal. The line is buffered in memory until
+ *    the next flush, or until the buffer is full.
+ *
+ * void housesensor_journal_flush (void);
+ *
+ *    Write all buffered lines to the journal file, using a single write.
+ *    The file is kept open between flushes.
+ *
+ * void housesensor_journal_close (void);
+ *
+ *    Flush and close the journal file, e.g. before it is moved. The file
+ *    is reopened on the next flush.
+ *
+ * long housesensor_journal_offset (time_t from);
+ *
+ *    Return an offset in the journal file such that all measurements at
+ *    or after from are after it. This is used to avoid scanning the whole
+ *    file when only the most recent measurements are needed. The journal
+ *    file is divided in chunks of JOURNAL_CHUNK seconds of measurements,
+ *    for which the offset and newest measurement are kept in memory. The
+ *    content of the file that predates the program is a single chunk.
+ *
+ * long long housesensor_journal_bytes (void);
+ * long long housesensor_journal_lines (void);
+ * long long housesensor_journal_dropped (void);
+ *
+ *    Return the number of bytes and lines written since the program
+ *    started, and the number of lines that could not be written.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "housesensor.h"
+#include "housesensor_journal.h"
+
+
+static const char *JournalName = 0;
+static int JournalFile = -1;
+
+static char JournalBuffer[65536];
+static int  JournalLength = 0;
+static int  JournalPendingLines = 0;
+static time_t JournalPendingLatest = 0;
+
+#define JOURNAL_CHUNK 300
+
+typedef struct {
+    long offset;
+    time_t first;
+    time_t latest;  // The newest measurement in this chunk.
+} JournalChunk;
+
+static JournalChunk *JournalChunks = 0;
+static int JournalChunkCount = 0;
+static int JournalChunkSize = 0;
+static long JournalSize = -1; // The size of the journal file, if open.
+
+static long long JournalBytes = 0;
+static long long JournalLines = 0;
+static long long JournalDropped = 0;
+
+
+void housesensor_journal_initialize (const char *name) {
+    JournalName = name;
+}
+
+static void JournalChunkAdd (long offset, time_t first, time_t latest) {
+
+    JournalChunk *c;
+
+    if (JournalChunkCount >= JournalChunkSize) {
+        JournalChunkSize = JournalChunkSize ? JournalChunkSize * 2 : 64;
+        JournalChunks =
+            realloc (JournalChunks, JournalChunkSize * sizeof(JournalChunk));
+        if (!JournalChunks) {
+            fprintf (stderr, "No enough memory for %d journal chunks\n",
+                     JournalChunkSize);
+            exit (1);
+        }
+    }
+    c = JournalChunks + JournalChunkCount++;
+    c->offset = offset;
+    c->first = first;
+    c->latest = latest;
+}
+
+// Account for measurements up to latest being written at the end of the
+// journal file.
+//
+static void JournalChunkUpdate (time_t latest) {
+
+    if (JournalChunkCount > 0) {
+        JournalChunk *c = JournalChunks + JournalChunkCount - 1;
+        if (latest < c->first + JOURNAL_CHUNK) {
+            if (latest > c->latest) c->latest = latest;
+            return;
+        }
+    }
+    JournalChunkAdd (JournalSize, latest, latest);
+}
+
+// Return 1 if all the data was written, 0 otherwise.
+//
+static int JournalWrite (const char *data, int length, time_t latest) {
+
+    if (JournalFile < 0) {
+        struct stat info;
+        if (!JournalName) return 0;
+        JournalFile = open (JournalName, O_WRONLY|O_APPEND|O_CREAT, 0644);
+        if (JournalFile < 0) {
+            if (echttp_isdebug())
+                printf ("Cannot open %s: %s\n", JournalName, strerror(errno));
+            return 0;
+        }
+        JournalChunkCount = 0;
+        JournalSize = (fstat (JournalFile, &info) == 0) ? info.st_size : -1;
+
+        // Whatever is already in the file was recorded before now.
+        //
+        if (JournalSize > 0) JournalChunkAdd (0, 0, time(0));
+    }
+    if (JournalSize >= 0) JournalChunkUpdate (latest);
+
+    while (length > 0) {
+        int written = write (JournalFile, data, length);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            if (echttp_isdebug())
+                printf ("Cannot write %s: %s\n", JournalName, strerror(errno));
+            JournalSize = lseek (JournalFile, 0, SEEK_END);
+            return 0;
+        }
+        data += written;
+        length -= written;
+        JournalBytes += written;
+        if (JournalSize >= 0) JournalSize += written;
+    }
+    return 1;
+}
+
+void housesensor_journal_flush (void) {
+
+    if (JournalLength <= 0) return;
+
+    if (JournalWrite (JournalBuffer, JournalLength, JournalPendingLatest))
+        JournalLines += JournalPendingLines;
+    else
+        JournalDropped += JournalPendingLines;
+    JournalLength = 0;
+    JournalPendingLines = 0;
+    JournalPendingLatest = 0;
+}
+
+void housesensor_journal_add (const char *line, int length) {
+
+    time_t timestamp = (time_t)atoll (line); // Each line starts with it.
+
+    if (JournalLength + length > sizeof(JournalBuffer)) {
+        housesensor_journal_flush ();
+        if (length > sizeof(JournalBuffer)) {
+            // Too long to be buffered.
+            if (JournalWrite (line, length, timestamp))
+                JournalLines += 1;
+            else
+                JournalDropped += 1;
+            return;
+        }
+    }
+    memcpy (JournalBuffer + JournalLength, line, length);
+    JournalLength += length;
+    JournalPendingLines += 1;
+    if (timestamp > JournalPendingLatest) JournalPendingLatest = timestamp;
+}
+
+void housesensor_journal_close (void) {
+
+    housesensor_journal_flush ();
+    if (JournalFile >= 0) {
+        close (JournalFile);
+        JournalFile = -1;
+    }
+    JournalChunkCount = 0;
+    JournalSize = -1;
+}
+
+long housesensor_journal_offset (time_t from) {
+
+    int i;
+
+    for (i = 0; i < JournalChunkCount; ++i) {
+        if (JournalChunks[i].latest >= from) return JournalChunks[i].offset;
+    }
+    return (JournalSize > 0) ? JournalSize : 0;
+}
+
+long long housesensor_journal_bytes (void) {
+    return JournalBytes;
+}
+
+long long housesensor_journal_lines (void) {
+    return JournalLines;
+}
+
+long long housesensor_journal_dropped (void) {
+    return JournalDropped;
+}
+
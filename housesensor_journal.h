@@ -0,0 +1,34 @@
+/* housesensor - A simple home web server for measurements.
+ *
+ * Copyright 2019, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housesensor_journal.h - The journal of measurements (CSV log).
+ */
+void housesensor_journal_initialize (const char *name);
+
+void housesensor_journal_add (const char *line, int length);
+void housesensor_journal_flush (void);
+void housesensor_journal_close (void);
+
+long housesensor_journal_offset (time_t from);
+
+long long housesensor_journal_bytes (void);
+long long housesensor_journal_lines (void);
+long long housesensor_journal_dropped (void);
+
@@ -0,0 +1,237 @@
+/* housesensor - A simple home web server for measurements.
+ *
+ * Copyright 2019, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housesensor_metrics.c - Runtime metrics of the service.
+ *
+ * SYNOPSIS:
+ *
+ * This module provides the common tools used by the other modules to
+ * measure their own activity, and to report it. Each module keeps its
+ * own counters and histograms, and reports them when requested. The
+ * counters are only updated from the main thread, so no lock is needed.
+ *
+ * long long housesensor_metrics_now (void);
+ *
+ *    Return the current time from a monotonic clock, in microseconds.
+ *
+ * void housesensor_metrics_observe (housesensor_histogram *h,
+ *                                   long long microseconds);
+ *
+ *    Add one duration to a histogram. All histograms use the same fixed
+ *    buckets, from 100 microseconds to 5 seconds. A histogram must be
+ *    initialized to zeroes.
+ *
+ * void housesensor_metrics_start (int json);
+ *
+ *    Start a new report, in JSON format if json is not 0, else in the
+ *    Prometheus text format.
+ *
+ * void housesensor_metrics_declare (const char *name, const char *type,
+ *                                   const char *help);
+ *
+ *    Start a new metric. The type is "counter", "gauge" or "histogram".
+ *
+ * void housesensor_metrics_value (const char *label, const char *value,
+ *                                 long long count);
+ * void housesensor_metrics_histogram (const char *label, const char *value,
+ *                                     const housesensor_histogram *h);
+ *
+ *    Add one series to the current metric. The series is identified by
+ *    one label and its value (no label if label is 0).
+ *
+ * const char *housesensor_metrics_end (void);
+ *
+ *    Return the complete report.
+ */
+
+#include "housesensor.h"
+#include "housesensor_db.h"
+#include "housesensor_output.h"
+#include "housesensor_metrics.h"
+
+
+// The upper bounds of the histogram buckets, in microseconds. These
+// cover both the web requests and the 1-Wire reads (a DS18B20 takes
+// up to 750ms to convert a temperature).
+//
+static const long long MetricsBounds[HOUSESENSOR_METRICS_BUCKETS] = {
+    100, 500, 1000, 5000, 10000, 50000, 100000,
+    250000, 500000, 750000, 1000000, 2500000, 5000000
+};
+static const char *MetricsBoundsText[HOUSESENSOR_METRICS_BUCKETS] = {
+    "0.0001", "0.0005", "0.001", "0.005", "0.01", "0.05", "0.1",
+    "0.25", "0.5", "0.75", "1", "2.5", "5"
+};
+
+static housesensor_output MetricsOutput;
+static int MetricsJson = 0;
+static const char *MetricsName = 0;
+static int MetricsSeries = 0;  // Number of series in the current metric.
+
+
+long long housesensor_metrics_now (void) {
+
+    struct timespec now;
+
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+void housesensor_metrics_observe (housesensor_histogram *h,
+                                  long long microseconds) {
+    int i;
+
+    h->count += 1;
+    h->sum += microseconds;
+    for (i = 0; i < HOUSESENSOR_METRICS_BUCKETS; ++i) {
+        if (microseconds <= MetricsBounds[i]) {
+            h->buckets[i] += 1;
+            break;
+        }
+    }
+}
+
+void housesensor_metrics_start (int json) {
+
+    MetricsJson = json;
+    MetricsName = 0;
+    housesensor_output_reset (&MetricsOutput, 0);
+    if (MetricsJson) {
+        housesensor_output_printf (&MetricsOutput,
+                    "{\"metrics\":{\"timestamp\":%lld,\"host\":\"%s\","
+                        "\"data\":[",
+                    (long long)time(0), housesensor_db_host());
+    }
+}
+
+void housesensor_metrics_declare (const char *name, const char *type,
+                                  const char *help) {
+
+    if (MetricsJson) {
+        housesensor_output_printf (&MetricsOutput,
+                    "%s{\"name\":\"%s\",\"type\":\"%s\",\"help\":\"%s\","
+                        "\"series\":[",
+                    MetricsName ? "]}," : "", name, type, help);
+    } else {
+        housesensor_output_printf (&MetricsOutput,
+                    "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+    }
+    MetricsName = name;
+    MetricsSeries = 0;
+}
+
+// Return the Prometheus labels for one series, with an optional
+// additional label (used for the histogram buckets).
+//
+static const char *MetricsLabels (char *buffer, int size,
+                                  const char *label, const char *value,
+                                  const char *le) {
+    if (label && le)
+        snprintf (buffer, size, "{%s=\"%s\",le=\"%s\"}", label, value, le);
+    else if (label)
+        snprintf (buffer, size, "{%s=\"%s\"}", label, value);
+    else if (le)
+        snprintf (buffer, size, "{le=\"%s\"}", le);
+    else
+        buffer[0] = 0;
+    return buffer;
+}
+
+static void MetricsJsonSeries (const char *label, const char *value) {
+
+    if (MetricsSeries) housesensor_output_append (&MetricsOutput, ",", 1);
+    housesensor_output_append (&MetricsOutput, "{", 1);
+    if (label)
+        housesensor_output_printf (&MetricsOutput,
+                                   "\"%s\":\"%s\",", label, value);
+    MetricsSeries += 1;
+}
+
+void housesensor_metrics_value (const char *label, const char *value,
+                                long long count) {
+
+    char labels[256];
+
+    if (!MetricsName) return;
+
+    if (MetricsJson) {
+        MetricsJsonSeries (label, value);
+        housesensor_output_printf (&MetricsOutput, "\"value\":%lld}", count);
+    } else {
+        housesensor_output_printf (&MetricsOutput, "%s%s %lld\n",
+                    MetricsName,
+                    MetricsLabels (labels, sizeof(labels), label, value, 0),
+                    count);
+    }
+}
+
+void housesensor_metrics_histogram (const char *label, const char *value,
+                                    const housesensor_histogram *h) {
+
+    char labels[256];
+    long long cumulative = 0;
+    int i;
+
+    if (!MetricsName) return;
+
+    if (MetricsJson) {
+        MetricsJsonSeries (label, value);
+        housesensor_output_printf (&MetricsOutput,
+                    "\"count\":%lld,\"sum\":%lld.%06lld,\"buckets\":[",
+                    h->count, h->sum / 1000000, h->sum % 1000000);
+        for (i = 0; i < HOUSESENSOR_METRICS_BUCKETS; ++i) {
+            cumulative += h->buckets[i];
+            housesensor_output_printf (&MetricsOutput, "%s[%s,%lld]",
+                        i ? "," : "", MetricsBoundsText[i], cumulative);
+        }
+        housesensor_output_append (&MetricsOutput, "]}", 2);
+        return;
+    }
+
+    for (i = 0; i < HOUSESENSOR_METRICS_BUCKETS; ++i) {
+        cumulative += h->buckets[i];
+        housesensor_output_printf (&MetricsOutput, "%s_bucket%s %lld\n",
+                    MetricsName,
+                    MetricsLabels (labels, sizeof(labels),
+                                   label, value, MetricsBoundsText[i]),
+                    cumulative);
+    }
+    housesensor_output_printf (&MetricsOutput, "%s_bucket%s %lld\n",
+                MetricsName,
+                MetricsLabels (labels, sizeof(labels), label, value, "+Inf"),
+                h->count);
+
+    MetricsLabels (labels, sizeof(labels), label, value, 0);
+    housesensor_output_printf (&MetricsOutput, "%s_sum%s %lld.%06lld\n",
+                MetricsName, labels, h->sum / 1000000, h->sum % 1000000);
+    housesensor_output_printf (&MetricsOutput, "%s_count%s %lld\n",
+                MetricsName, labels, h->count);
+}
+
+const char *housesensor_metrics_end (void) {
+
+    if (MetricsJson) {
+        if (MetricsName) housesensor_output_append (&MetricsOutput, "]}", 2);
+        housesensor_output_append (&MetricsOutput, "]}}", 3);
+    }
+    MetricsName = 0;
+    return MetricsOutput.data;
+}
+
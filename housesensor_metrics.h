@@ -0,0 +1,43 @@
+/* housesensor - A simple home web server for measurements.
+ *
+ * Copyright 2019, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housesensor_metrics.h - Runtime metrics of the service.
+ */
+#define HOUSESENSOR_METRICS_BUCKETS 13
+
+typedef struct {
+    long long count;
+    long long sum;    // Microseconds.
+    long long buckets[HOUSESENSOR_METRICS_BUCKETS];
+} housesensor_histogram;
+
+long long housesensor_metrics_now (void);
+void housesensor_metrics_observe (housesensor_histogram *h,
+                                  long long microseconds);
+
+void housesensor_metrics_start (int json);
+void housesensor_metrics_declare (const char *name, const char *type,
+                                  const char *help);
+void housesensor_metrics_value (const char *label, const char *value,
+                                long long count);
+void housesensor_metrics_histogram (const char *label, const char *value,
+                                    const housesensor_histogram *h);
+const char *housesensor_metrics_end (void);
+
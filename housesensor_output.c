@@ -0,0 +1,142 @@
+/* housesensor - A simple home web server for measurements.
+ *
+ * Copyright 2019, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housesensor_output.c - A growable buffer to build responses.
+ *
+ * SYNOPSIS:
+ *
+ * This module builds a text response piece by piece. The buffer grows
+ * as needed, so the response is never truncated, and the length is
+ * tracked as each piece is added: the text is never scanned again.
+ * The buffer is kept between responses, so that it rarely needs to grow
+ * once the service has been running for a while.
+ *
+ * A housesensor_output structure must be initialized to zeroes before
+ * it is used for the first time. The text is always null terminated.
+ *
+ * void housesensor_output_reset (housesensor_output *out, int reserve);
+ *
+ *    Start a new response. The first reserve bytes of the buffer are
+ *    left unused, so that a prefix of up to this size can be added at
+ *    the end, using housesensor_output_prefix().
+ *
+ * void housesensor_output_append (housesensor_output *out,
+ *                                 const char *text, int length);
+ * void housesensor_output_string (housesensor_output *out, const char *text);
+ * void housesensor_output_printf (housesensor_output *out,
+ *                                 const char *format, ...);
+ *
+ *    Add text to the response.
+ *
+ * const char *housesensor_output_prefix (housesensor_output *out,
+ *                                        int reserve, const char *text);
+ *
+ *    Return the complete response, including the specified prefix. The
+ *    prefix is truncated if it is larger than the reserved space.
+ *    This does not modify the text after the reserved space, so that the
+ *    same response can be returned again with a different prefix.
+ */
+
+#include <stdarg.h>
+
+#include "housesensor.h"
+#include "housesensor_output.h"
+
+
+static void OutputGrow (housesensor_output *out, int length) {
+
+    int size = out->size ? out->size : 64;
+
+    if (out->length + length < out->size) return;
+
+    // Double the buffer: appending many small pieces then only costs
+    // a logarithmic number of reallocations.
+    //
+    while (out->length + length >= size) size *= 2;
+    out->size = size;
+    out->data = realloc (out->data, out->size);
+    if (!out->data) {
+        fprintf (stderr, "No enough memory for %d bytes of output\n",
+                 out->size);
+        exit (1);
+    }
+}
+
+void housesensor_output_reset (housesensor_output *out, int reserve) {
+
+    out->length = 0;
+    OutputGrow (out, reserve);
+    out->length = reserve;
+    out->data[out->length] = 0;
+}
+
+void housesensor_output_append (housesensor_output *out,
+                                const char *text, int length) {
+
+    OutputGrow (out, length);
+    memcpy (out->data + out->length, text, length);
+    out->length += length;
+    out->data[out->length] = 0;
+}
+
+void housesensor_output_string (housesensor_output *out, const char *text) {
+    housesensor_output_append (out, text, strlen(text));
+}
+
+void housesensor_output_printf (housesensor_output *out,
+                                const char *format, ...) {
+
+    va_list args;
+    int length;
+
+    OutputGrow (out, 0);
+
+    va_start (args, format);
+    length = vsnprintf (out->data + out->length,
+                        out->size - out->length, format, args);
+    va_end (args);
+
+    if (length < 0) {
+        out->data[out->length] = 0;
+        return;
+    }
+    if (length >= out->size - out->length) {
+        // The text did not fit: make room and format it again.
+        //
+        OutputGrow (out, length);
+        va_start (args, format);
+        vsnprintf (out->data + out->length,
+                   out->size - out->length, format, args);
+        va_end (args);
+    }
+    out->length += length;
+}
+
+const char *housesensor_output_prefix (housesensor_output *out,
+                                       int reserve, const char *text) {
+
+    int length = strlen(text);
+
+    if (!out->data) return text;
+    if (length > reserve) length = reserve;
+    memcpy (out->data + reserve - length, text, length);
+    return out->data + reserve - length;
+}
+
@@ -0,0 +1,37 @@
+/* housesensor - A simple home web server for measurements.
+ *
+ * Copyright 2019, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housesensor_output.h - A growable buffer to build responses.
+ */
+typedef struct {
+    char *data;
+    int   length;
+    int   size;
+} housesensor_output;
+
+void housesensor_output_reset (housesensor_output *out, int reserve);
+void housesensor_output_append (housesensor_output *out,
+                                const char *text, int length);
+void housesensor_output_string (housesensor_output *out, const char *text);
+void housesensor_output_printf (housesensor_output *out,
+                                const char *format, ...);
+const char *housesensor_output_prefix (housesensor_output *out,
+                                       int reserve, const char *text);
+
@@ -0,0 +1,471 @@
+/* housesensor - A simple home web server for measurements.
+ *
+ * Copyright 2019, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housesensor_query.c - Time range queries over the recorded history.
+ *
+ * SYNOPSIS:
+ *
+ * void housesensor_query_initialize (const char *log);
+ *
+ *    Set the name of the log file for the current day. Must be called once.
+ *
+ * const char *housesensor_query (const char *location, const char *name,
+ *                                time_t from, time_t to, int step);
+ *
+ *    Return the numeric measurements recorded between from and to for the
+ *    sensors that match the location and name (a null location or name
+ *    matches all). The measurements are aggregated in buckets of step
+ *    seconds: for each bucket that has at least one measurement, the
+ *    minimum, maximum and average values are returned, in JSON format.
+ *    If step is 0 or would produce too many buckets, a larger step is
+ *    selected. The number of series is limited by the memory used for
+ *    their buckets (QUERY_MAX_POINTS): the series beyond this limit are
+ *    left out, and the response is then marked as truncated.
+ *
+ * Only the archives for the days in the time range are read, and they
+ * are mapped in memory instead of being copied. If an archive is indexed,
+ * only the regions of the archive that may match are scanned. The current
+ * day is read from the log, starting from the offset the journal gives
+ * for the start of the time range, and the archive for the current day
+ * (a periodic copy of the log) is ignored for the period covered by the
+ * log.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+
+#include "housesensor.h"
+#include "housesensor_db.h"
+#include "housesensor_archive.h"
+#include "housesensor_binary.h"
+#include "housesensor_index.h"
+#include "housesensor_journal.h"
+#include "housesensor_output.h"
+#include "housesensor_query.h"
+
+
+#define QUERY_MAX_BUCKETS 1000
+#define QUERY_MAX_POINTS  1000000 // Buckets, for all series.
+
+static const char *QueryLog = 0;
+
+typedef struct {
+    long long min;
+    long long max;
+    long long sum;
+    int count;
+} QueryBucket;
+
+typedef struct {
+    char *location;
+    char *name;
+    char *unit;
+    unsigned int hash;
+    QueryBucket *buckets;
+} QuerySeries;
+
+typedef struct {
+    const char *location;  // Filter, or 0.
+    const char *name;      // Filter, or 0.
+    time_t from;
+    time_t to;
+    time_t limit;          // Ignore measurements from this time, if not 0.
+    int step;
+    int count;             // Number of buckets.
+    QuerySeries *series;
+    int seriescount;
+    int seriessize;
+    int *slot;             // Hash index of the series, -1 if empty.
+    int slotsize;          // A power of 2, at least twice seriescount.
+    int truncated;         // Some series were left out.
+} QueryContext;
+
+
+void housesensor_query_initialize (const char *log) {
+    QueryLog = log;
+}
+
+static int QueryMatch (const char *filter, const char *text, int length) {
+    if (!filter) return 1;
+    return (strncmp (filter, text, length) == 0 && filter[length] == 0);
+}
+
+static unsigned int QueryHashText (unsigned int hash,
+                                   const char *text, int length) {
+    while (length-- > 0) hash = (hash ^ (unsigned char)(*text++)) * 16777619u;
+    return hash;
+}
+
+// Make room in the hash index for one more series.
+//
+static void QueryIndexReserve (QueryContext *q) {
+
+    int size = q->slotsize ? q->slotsize : 128;
+    int i;
+
+    if (2 * (q->seriescount + 1) <= q->slotsize) return;
+
+    while (2 * (q->seriescount + 1) > size) size *= 2;
+    q->slot = realloc (q->slot, size * sizeof(int));
+    if (!q->slot) {
+        fprintf (stderr, "No enough memory for %d hash entries\n", size);
+        exit (1);
+    }
+    q->slotsize = size;
+    for (i = 0; i < size; ++i) q->slot[i] = -1;
+    for (i = 0; i < q->seriescount; ++i) {
+        unsigned int slot = q->series[i].hash & (size - 1);
+        while (q->slot[slot] >= 0) slot = (slot + 1) & (size - 1);
+        q->slot[slot] = i;
+    }
+}
+
+static QuerySeries *QueryFind (QueryContext *q,
+                               const char *location, int locationlength,
+                               const char *name, int namelength,
+                               const char *unit, int unitlength) {
+
+    QuerySeries *s;
+    unsigned int hash;
+    unsigned int slot;
+
+    hash = QueryHashText (2166136261u, location, locationlength); // FNV-1a.
+    hash = (hash ^ '.') * 16777619u;
+    hash = QueryHashText (hash, name, namelength);
+    hash = (hash ^ '.') * 16777619u;
+    hash = QueryHashText (hash, unit, unitlength);
+
+    if (q->slotsize) {
+        for (slot = hash & (q->slotsize - 1);
+             q->slot[slot] >= 0; slot = (slot + 1) & (q->slotsize - 1)) {
+            s = q->series + q->slot[slot];
+            if (s->hash == hash &&
+                QueryMatch (s->location, location, locationlength) &&
+                QueryMatch (s->name, name, namelength) &&
+                QueryMatch (s->unit, unit, unitlength)) return s;
+        }
+    }
+    if ((long)(q->seriescount + 1) * q->count > QUERY_MAX_POINTS) {
+        q->truncated = 1;
+        return 0;
+    }
+    if (q->seriescount >= q->seriessize) {
+        q->seriessize = q->seriessize ? q->seriessize * 2 : 64;
+        q->series = realloc (q->series, q->seriessize * sizeof(QuerySeries));
+        if (!q->series) {
+            fprintf (stderr, "No enough memory for %d series\n",
+                     q->seriessize);
+            exit (1);
+        }
+    }
+    s = q->series + q->seriescount;
+    s->buckets = calloc (q->count, sizeof(QueryBucket));
+    if (!s->buckets) {
+        q->truncated = 1;
+        return 0;
+    }
+    s->location = strndup (location, locationlength);
+    s->name = strndup (name, namelength);
+    s->unit = strndup (unit, unitlength);
+    s->hash = hash;
+
+    QueryIndexReserve (q); // May rehash all the existing series.
+    for (slot = hash & (q->slotsize - 1);
+         q->slot[slot] >= 0; slot = (slot + 1) & (q->slotsize - 1)) ;
+    q->slot[slot] = q->seriescount++;
+    return s;
+}
+
+static void QueryAdd (QuerySeries *s, int index, long long value) {
+
+    QueryBucket *b = s->buckets + index;
+
+    if (b->count == 0 || value < b->min) b->min = value;
+    if (b->count == 0 || value > b->max) b->max = value;
+    b->sum += value;
+    b->count += 1;
+}
+
+// Scan one CSV file. The fields are compared in place: nothing is copied
+// except for the value, which is short and must be parsed anyway.
+//
+static time_t QueryScanCsv (QueryContext *q, const char *data, int size) {
+
+    const char *end = data + size;
+    const char *line = data;
+    time_t first = 0;
+
+    while (line < end) {
+        const char *field[5];
+        int length[5];
+        char value[32];
+        long long number;
+        QuerySeries *s;
+        const char *p = line;
+        const char *eol = memchr (line, '\n', end - line);
+        time_t timestamp = 0;
+        int count = 0;
+
+        if (!eol) eol = end;
+        line = eol + 1;
+
+        while (p < eol && *p >= '0' && *p <= '9')
+            timestamp = (timestamp * 10) + (*(p++) - '0');
+        if (p >= eol || *p != ',') continue;
+        if (!first) first = timestamp;
+        if (timestamp < q->from || timestamp >= q->to) continue;
+        if (q->limit && timestamp >= q->limit) continue;
+
+        while (p < eol && count < 5) {
+            const char *next;
+            p += 1; // Skip the comma.
+            next = (count < 3) ? memchr (p, ',', eol - p) : 0;
+            if (!next) next = eol;
+            field[count] = p;
+            length[count++] = next - p;
+            p = next;
+        }
+        if (count < 3) continue;
+        if (count < 4) {
+            field[3] = "";
+            length[3] = 0;
+        }
+        if (!QueryMatch (q->location, field[0], length[0])) continue;
+        if (!QueryMatch (q->name, field[1], length[1])) continue;
+
+        if (length[2] >= sizeof(value)) continue;
+        memcpy (value, field[2], length[2]);
+        value[length[2]] = 0;
+        if (!housesensor_db_parse (value, &number)) continue;
+
+        s = QueryFind (q, field[0], length[0],
+                          field[1], length[1], field[3], length[3]);
+        if (s) QueryAdd (s, (timestamp - q->from) / q->step, number);
+    }
+    return first;
+}
+
+typedef struct {
+    QueryContext *query;
+    const char *data;
+} QueryRegion;
+
+static void QueryRegionListener (void *context, long offset, long length) {
+
+    QueryRegion *region = (QueryRegion *)context;
+
+    QueryScanCsv (region->query, region->data + offset, length);
+}
+
+// Return the time of the first measurement in a CSV file.
+//
+static time_t QueryFirst (const char *data, long size) {
+
+    const char *end = data + size;
+
+    while (data < end) {
+        const char *eol = memchr (data, '\n', end - data);
+        time_t timestamp = 0;
+        if (!eol) eol = end;
+        while (data < eol && *data >= '0' && *data <= '9')
+            timestamp = (timestamp * 10) + (*(data++) - '0');
+        if (data < eol && *data == ',') return timestamp;
+        data = eol + 1;
+    }
+    return 0;
+}
+
+// Map a CSV file in memory and scan it, from offset start, or only the
+// regions selected by its index if requested and available. Set first to
+// the time of the first measurement in the file. Return 0 if the file
+// does not exist or is empty.
+//
+static int QueryFile (QueryContext *q, const char *name,
+                      long start, int indexed, time_t *first) {
+
+    struct stat info;
+    void *data;
+    QueryRegion region;
+    int fd = open (name, O_RDONLY);
+
+    *first = 0;
+    if (fd < 0) return 0;
+    if (fstat (fd, &info) < 0 || info.st_size <= 0) {
+        close (fd);
+        return 0;
+    }
+    data = mmap (0, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close (fd);
+    if (data == MAP_FAILED) return 0;
+
+    region.query = q;
+    region.data = (const char *)data;
+    if (!indexed ||
+        !housesensor_index_select (name, info.st_size, q->from, q->to,
+                                   q->location, q->name,
+                                   QueryRegionListener, &region)) {
+        if (start <= 0 || start > info.st_size) start = 0;
+        madvise (data, info.st_size, MADV_SEQUENTIAL);
+        *first = QueryScanCsv (q, (const char *)data + start,
+                               info.st_size - start);
+        if (start > 0) *first = QueryFirst ((const char *)data, start);
+    }
+    munmap (data, info.st_size);
+    return 1;
+}
+
+static void QueryBinaryListener (void *context,
+                                 const char *location,
+                                 const char *name,
+                                 const char *unit,
+                                 time_t timestamp,
+                                 long long value,
+                                 const char *text) {
+
+    QueryContext *q = (QueryContext *)context;
+    QuerySeries *s;
+
+    if (text) return; // Not numeric.
+    if (timestamp < q->from || timestamp >= q->to) return;
+    if (q->limit && timestamp >= q->limit) return;
+    if (!QueryMatch (q->location, location, strlen(location))) return;
+    if (!QueryMatch (q->name, name, strlen(name))) return;
+
+    s = QueryFind (q, location, strlen(location),
+                      name, strlen(name), unit, strlen(unit));
+    if (s) QueryAdd (s, (timestamp - q->from) / q->step, value);
+}
+
+static void QueryDay (time_t timestamp, char *day, int size) {
+
+    struct tm t;
+
+    localtime_r (&timestamp, &t);
+    snprintf (day, size, "%04d-%02d-%02d",
+              t.tm_year+1900, t.tm_mon+1, t.tm_mday);
+}
+
+// Walk the list of the existing archives, for the days in the time range.
+// The archive for a day also contains the measurements made just after
+// midnight, before the log was moved: start with the day before.
+//
+static void QueryArchives (QueryContext *q) {
+
+    char first[40];
+    char last[40];
+    char name[256];
+    time_t start;
+    int count = housesensor_archive_count ();
+    int i;
+
+    QueryDay (q->from - 86400, first, sizeof(first));
+    QueryDay (q->to, last, sizeof(last));
+
+    for (i = housesensor_archive_search (first); i < count; ++i) {
+        const char *day = housesensor_archive_day (i);
+        if (!day || strcmp (day, last) > 0) break;
+
+        snprintf (name, sizeof(name), "%s/%s.csv",
+                  housesensor_archive_directory(), day);
+        if (!QueryFile (q, name, 0, 1, &start)) {
+            strcpy (name + strlen(name) - 4, ".hsb");
+            housesensor_binary_read (name, QueryBinaryListener, q);
+        }
+    }
+}
+
+const char *housesensor_query (const char *location, const char *name,
+                               time_t from, time_t to, int step) {
+
+    static QueryContext q;
+    static housesensor_output buffer;
+
+    time_t now = time(0);
+    int i, j;
+
+    if (to <= 0 || to > now + 1) to = now + 1;
+    if (from <= 0 || from >= to) from = to - 86400;
+    if (step <= 0) step = (to - from) / 100;
+    if ((to - from) / step >= QUERY_MAX_BUCKETS)
+        step = (to - from) / QUERY_MAX_BUCKETS + 1;
+    if (step <= 0) step = 1;
+
+    q.location = (location && *location) ? location : 0;
+    q.name = (name && *name) ? name : 0;
+    q.from = from;
+    q.to = to;
+    q.step = step;
+    q.count = (to - from + step - 1) / step;
+    q.seriescount = 0;
+    q.truncated = 0;
+    if (q.slot) memset (q.slot, 0xff, q.slotsize * sizeof(int)); // All -1.
+
+    // The log is read first, to know which period it covers. Only the
+    // part of the log that may hold measurements in range is scanned.
+    //
+    q.limit = 0;
+    if (QueryLog)
+        QueryFile (&q, QueryLog,
+                   housesensor_journal_offset (from), 0, &q.limit);
+    if (q.limit == 0 || q.limit > from) QueryArchives (&q);
+
+    housesensor_output_reset (&buffer, 0);
+    housesensor_output_printf (&buffer,
+                "{\"sensor\":{\"timestamp\":%lld,\"host\":\"%s\","
+                    "\"query\":{\"from\":%lld,\"to\":%lld,\"step\":%d,"
+                    "%s\"series\":[",
+                (long long)now, housesensor_db_host(),
+                (long long)from, (long long)to, step,
+                q.truncated ? "\"truncated\":true," : "");
+
+    for (i = 0; i < q.seriescount; ++i) {
+        QuerySeries *s = q.series + i;
+        const char *prefix = "";
+        housesensor_output_printf (&buffer,
+                    "%s{\"location\":\"%s\",\"name\":\"%s\",\"unit\":\"%s\","
+                        "\"data\":[",
+                    i ? "," : "", s->location, s->name, s->unit);
+        for (j = 0; j < q.count; ++j) {
+            QueryBucket *b = s->buckets + j;
+            char min[24], max[24], avg[24];
+            long long average;
+            if (!b->count) continue;
+            average = b->sum / b->count;
+            if ((b->sum % b->count) * 2 >= b->count) average += 1;
+            else if ((b->sum % b->count) * 2 <= -b->count) average -= 1;
+            housesensor_output_printf (&buffer, "%s[%lld,%s,%s,%s]", prefix,
+                        (long long)(from + (long long)j * step),
+                        housesensor_db_format (min, b->min),
+                        housesensor_db_format (max, b->max),
+                        housesensor_db_format (avg, average));
+            prefix = ",";
+        }
+        housesensor_output_append (&buffer, "]}", 2);
+        free (s->location);
+        free (s->name);
+        free (s->unit);
+        free (s->buckets);
+    }
+    housesensor_output_append (&buffer, "]}}}", 4);
+    return buffer.data;
+}
+
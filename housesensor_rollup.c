@@ -0,0 +1,253 @@
+/* housesensor - A simple home web server for measurements.
+ *
+ * Copyright 2019, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housesensor_rollup.c - Minute, hour and day summaries of measurements.
+ *
+ * SYNOPSIS:
+ *
+ * void housesensor_rollup_add (int sensor,
+ *                              const char *location, const char *name,
+ *                              const char *unit,
+ *                              time_t timestamp, long long value);
+ *
+ *    Account for a new numeric measurement (in thousandths) of the
+ *    specified sensor. The sensor is identified by its database index.
+ *    This takes a constant time: each tier only updates its current
+ *    bucket, closing it first if the measurement falls after its end.
+ *
+ * void housesensor_rollup_flush (time_t now);
+ *
+ *    Close the buckets that ended before now, even if there was no new
+ *    measurement, and append all the closed buckets to the rollup files.
+ *    There is one rollup file per day, named after the day when the
+ *    bucket started. This is called every minute, so that the closed
+ *    buckets are not accumulated in memory.
+ *
+ * The tiers are minute, hour and (local) day. Each bucket holds the count,
+ * minimum, maximum, sum and last of the measurements. The rollup files
+ * are CSV files, where each line is one bucket with the fields:
+ * start, period (in seconds: a day may last 23 or 25 hours), location,
+ * name, count, min, max, sum, last, unit.
+ */
+
+#include "echttp_libc.h"
+
+#include "housesensor.h"
+#include "housesensor_db.h"
+#include "housesensor_archive.h"
+#include "housesensor_rollup.h"
+
+
+#define ROLLUP_MINUTE 0
+#define ROLLUP_HOUR   1
+#define ROLLUP_DAY    2
+#define ROLLUP_TIERS  3
+
+static const int RollupPeriod[ROLLUP_TIERS] = {60, 3600, 86400};
+
+typedef struct {
+    time_t start;
+    time_t end;
+    int count;
+    long long min;
+    long long max;
+    long long sum;
+    long long last;
+} RollupBucket;
+
+typedef struct {
+    char *location;
+    char *name;
+    char unit[32];
+    RollupBucket current[ROLLUP_TIERS]; // Not active if count is 0.
+} RollupSensor;
+
+typedef struct {
+    int sensor;
+    int tier;
+    RollupBucket bucket;
+} RollupClosed;
+
+static RollupSensor *RollupSensors = 0;
+static int RollupSensorCount = 0;
+
+static RollupClosed *RollupClosedList = 0;
+static int RollupClosedCount = 0;
+static int RollupClosedSize = 0;
+
+
+static time_t RollupDayStart (time_t timestamp, time_t *end) {
+
+    struct tm day;
+
+    localtime_r (&timestamp, &day);
+    day.tm_hour = day.tm_min = day.tm_sec = 0;
+    day.tm_isdst = -1;
+    timestamp = mktime (&day);
+
+    day.tm_mday += 1;
+    day.tm_isdst = -1;
+    *end = mktime (&day);
+    return timestamp;
+}
+
+static void RollupClose (int sensor, int tier) {
+
+    RollupBucket *b = RollupSensors[sensor].current + tier;
+    RollupClosed *closed;
+
+    if (RollupClosedCount >= RollupClosedSize) {
+        RollupClosedSize = RollupClosedSize ? RollupClosedSize * 2 : 256;
+        RollupClosedList =
+            realloc (RollupClosedList, RollupClosedSize * sizeof(RollupClosed));
+        if (!RollupClosedList) {
+            fprintf (stderr, "No enough memory for %d buckets\n",
+                     RollupClosedSize);
+            exit (1);
+        }
+    }
+    closed = RollupClosedList + RollupClosedCount++;
+    closed->sensor = sensor;
+    closed->tier = tier;
+    closed->bucket = *b;
+    b->count = 0;
+}
+
+static void RollupOpen (RollupBucket *b, int tier, time_t timestamp) {
+
+    if (tier == ROLLUP_DAY) {
+        b->start = RollupDayStart (timestamp, &(b->end));
+    } else {
+        b->start = timestamp - (timestamp % RollupPeriod[tier]);
+        b->end = b->start + RollupPeriod[tier];
+    }
+}
+
+void housesensor_rollup_add (int sensor,
+                             const char *location, const char *name,
+                             const char *unit,
+                             time_t timestamp, long long value) {
+
+    RollupSensor *s;
+    int tier;
+
+    if (sensor < 0) return;
+    if (sensor >= RollupSensorCount) {
+        RollupSensors =
+            realloc (RollupSensors, (sensor + 1) * sizeof(RollupSensor));
+        if (!RollupSensors) {
+            fprintf (stderr, "No enough memory for %d sensors\n", sensor+1);
+            exit (1);
+        }
+        memset (RollupSensors + RollupSensorCount, 0,
+                (sensor + 1 - RollupSensorCount) * sizeof(RollupSensor));
+        RollupSensorCount = sensor + 1;
+    }
+    s = RollupSensors + sensor;
+    if (!s->location) {
+        s->location = strdup (location);
+        s->name = strdup (name);
+    }
+    if (unit) strtcpy (s->unit, unit, sizeof(s->unit));
+
+    for (tier = 0; tier < ROLLUP_TIERS; ++tier) {
+        RollupBucket *b = s->current + tier;
+        if (b->count > 0 && timestamp >= b->end) RollupClose (sensor, tier);
+        if (b->count == 0) {
+            RollupOpen (b, tier, timestamp);
+            b->min = b->max = value;
+            b->sum = 0;
+        } else {
+            if (value < b->min) b->min = value;
+            if (value > b->max) b->max = value;
+        }
+        b->sum += value;
+        b->last = value;
+        b->count += 1;
+    }
+}
+
+static void RollupFileName (time_t start, char *name, int size) {
+
+    struct tm day;
+
+    localtime_r (&start, &day);
+    snprintf (name, size, "%s/%04d-%02d-%02d.rollup",
+              housesensor_archive_directory(),
+              day.tm_year+1900, day.tm_mon+1, day.tm_mday);
+}
+
+void housesensor_rollup_flush (time_t now) {
+
+    char current[256];
+    FILE *out = 0;
+    int sensor;
+    int tier;
+    int i;
+
+    for (sensor = 0; sensor < RollupSensorCount; ++sensor) {
+        for (tier = 0; tier < ROLLUP_TIERS; ++tier) {
+            RollupBucket *b = RollupSensors[sensor].current + tier;
+            if (b->count > 0 && now >= b->end) RollupClose (sensor, tier);
+        }
+    }
+    if (RollupClosedCount <= 0) return;
+
+    // The closed buckets are mostly for the same day, so the current
+    // file is reused as long as possible.
+    //
+    current[0] = 0;
+    for (i = 0; i < RollupClosedCount; ++i) {
+        RollupClosed *closed = RollupClosedList + i;
+        RollupSensor *s = RollupSensors + closed->sensor;
+        RollupBucket *b = &(closed->bucket);
+        char name[256];
+        char min[24], max[24], sum[24], last[24];
+
+        RollupFileName (b->start, name, sizeof(name));
+        if (strcmp (name, current)) {
+            if (out) fclose (out);
+            out = fopen (name, "a");
+            if (!out) {
+                if (echttp_isdebug()) printf ("Cannot open %s\n", name);
+                break; // Keep the remaining buckets for the next attempt.
+            }
+            strtcpy (current, name, sizeof(current));
+        }
+        // The length of a day is not always 86400 seconds, because of
+        // daylight saving time: the actual length is written.
+        //
+        fprintf (out, "%lld,%d,%s,%s,%d,%s,%s,%s,%s,%s\n",
+                 (long long)b->start, (int)(b->end - b->start),
+                 s->location, s->name, b->count,
+                 housesensor_db_format (min, b->min),
+                 housesensor_db_format (max, b->max),
+                 housesensor_db_format (sum, b->sum),
+                 housesensor_db_format (last, b->last), s->unit);
+    }
+    if (out) fclose (out);
+    if (echttp_isdebug()) printf ("Saved %d rollup buckets\n", i);
+
+    RollupClosedCount -= i;
+    if (RollupClosedCount > 0)
+        memmove (RollupClosedList, RollupClosedList + i,
+                 RollupClosedCount * sizeof(RollupClosed));
+}
+
@@ -0,0 +1,478 @@
+/* housesensor - A simple home web server for measurements.
+ *
+ * Copyright 2019, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housesensor_stream.c - Push the new measurements to subscribers.
+ *
+ * SYNOPSIS:
+ *
+ * void housesensor_stream_initialize (int argc, const char **argv);
+ *
+ *    Open the stream sockets, for the same IP versions and addresses as
+ *    the web server. The port is set by the stream.port option (default:
+ *    any port available). This must be called after echttp_open().
+ *
+ * int housesensor_stream_port (void);
+ *
+ *    Return the port of the stream socket, or 0 if there is none.
+ *
+ * int housesensor_stream_active (void);
+ *
+ *    Return the number of subscribers. There is no need to render the
+ *    new measurements for publication if this is 0.
+ *
+ * void housesensor_stream_publish (long long id, const char *data,
+ *                                  int length);
+ *
+ *    Send one event to all the subscribers. The id is the sequence number
+ *    of the measurement, and the data its JSON description.
+ *
+ * void housesensor_stream_metrics (void);
+ *
+ *    Report the number of subscribers, of events published and of
+ *    subscribers dropped.
+ *
+ * void housesensor_stream_background (time_t now);
+ *
+ *    Send keep-alive comments to idle subscribers and close connections
+ *    that did not send a complete request in time.
+ *
+ * The stream is served as Server-Sent Events (text/event-stream) on its
+ * own socket, because the echttp responses are built in one call and
+ * cannot be left open. The web server redirects /sensor/stream to this
+ * socket. The stream is not proxied by houseportal: the clients connect
+ * to it directly, even when they reached the web server through the
+ * portal. The stream socket is handled from the echttp main loop, using
+ * echttp_listen(), and never blocks: each subscriber has a bounded queue
+ * (stream.queue option, in bytes) of the events that could not be sent
+ * yet, and a subscriber whose queue is full is disconnected, so that a
+ * slow client never delays the acquisition or the other subscribers.
+ * The client may reconnect, and use /sensor/recent with the id of the
+ * last event received to recover the events it missed.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "housesensor.h"
+#include "housesensor_db.h"
+#include "housesensor_output.h"
+#include "housesensor_metrics.h"
+#include "housesensor_stream.h"
+
+
+typedef struct {
+    int fd;            // -1 if this slot is free.
+    int streaming;     // 0 while the request is being received.
+    int writing;       // Listening for the socket to be writable.
+    time_t active;     // When something was last sent, or connected.
+    char request[1024];
+    int received;
+    char *queue;       // Ring of the bytes waiting to be sent.
+    int head;
+    int count;
+} StreamSubscriber;
+
+static StreamSubscriber *StreamSubscribers = 0;
+static int StreamSubscriberSize = 0;
+static int StreamSubscriberCount = 0; // Streaming subscribers only.
+
+static int StreamSocket4 = -1;
+static int StreamSocket6 = -1;
+static int StreamPort = 0;
+
+static int StreamQueueSize = 65536;
+static int StreamSubscriberLimit = 64;
+
+#define STREAM_KEEPALIVE 30 // Seconds.
+#define STREAM_REQUEST   10 // Seconds to send the request.
+
+static long long StreamPublished = 0;
+static long long StreamDropped = 0;
+static long long StreamRejected = 0;
+
+static const char StreamHeader[] =
+    "HTTP/1.1 200 OK\r\n"
+    "Content-Type: text/event-stream\r\n"
+    "Cache-Control: no-cache\r\n"
+    "Connection: keep-alive\r\n"
+    "Access-Control-Allow-Origin: *\r\n"
+    "\r\n"
+    "retry: 5000\n\n";
+
+static const char StreamNotFound[] =
+    "HTTP/1.1 404 Not Found\r\n"
+    "Content-Length: 0\r\n"
+    "Connection: close\r\n"
+    "\r\n";
+
+
+static void StreamReceive (int fd, int mode);
+
+static StreamSubscriber *StreamSearch (int fd) {
+
+    int i;
+
+    for (i = 0; i < StreamSubscriberSize; ++i) {
+        if (StreamSubscribers[i].fd == fd) return StreamSubscribers + i;
+    }
+    return 0;
+}
+
+static void StreamClose (StreamSubscriber *s) {
+
+    echttp_forget (s->fd);
+    close (s->fd);
+    if (echttp_isdebug())
+        printf ("Stream subscriber %d disconnected\n", s->fd);
+    s->fd = -1;
+    if (s->streaming) StreamSubscriberCount -= 1;
+    s->streaming = 0;
+    free (s->queue);
+    s->queue = 0;
+}
+
+static void StreamListen (StreamSubscriber *s) {
+
+    int writing = (s->count > 0);
+
+    if (writing == s->writing) return;
+    s->writing = writing;
+    echttp_forget (s->fd);
+    echttp_listen (s->fd, writing ? 3 : 1, StreamReceive, 0);
+}
+
+// Send as much of the queue as the socket accepts. Return 0 if the
+// subscriber was disconnected.
+//
+static int StreamFlush (StreamSubscriber *s) {
+
+    while (s->count > 0) {
+        int length = StreamQueueSize - s->head;
+        if (length > s->count) length = s->count;
+
+        length = send (s->fd, s->queue + s->head, length,
+                       MSG_NOSIGNAL|MSG_DONTWAIT);
+        if (length < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            StreamClose (s);
+            return 0;
+        }
+        s->head = (s->head + length) % StreamQueueSize;
+        s->count -= length;
+    }
+    if (s->count == 0) s->head = 0;
+    StreamListen (s);
+    return 1;
+}
+
+// Send data to one subscriber, queueing what the socket did not accept.
+// A subscriber that cannot keep up is disconnected.
+//
+static void StreamSend (StreamSubscriber *s, const char *data, int length) {
+
+    int tail;
+
+    if (s->count == 0) {
+        int sent = send (s->fd, data, length, MSG_NOSIGNAL|MSG_DONTWAIT);
+        if (sent < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                StreamClose (s);
+                return;
+            }
+            sent = 0;
+        }
+        s->active = time(0);
+        data += sent;
+        length -= sent;
+        if (length == 0) return;
+    }
+
+    if (s->count + length > StreamQueueSize) {
+        if (echttp_isdebug())
+            printf ("Stream subscriber %d is too slow\n", s->fd);
+        StreamDropped += 1;
+        StreamClose (s);
+        return;
+    }
+
+    tail = (s->head + s->count) % StreamQueueSize;
+    while (length > 0) {
+        int chunk = StreamQueueSize - tail;
+        if (chunk > length) chunk = length;
+        memcpy (s->queue + tail, data, chunk);
+        s->count += chunk;
+        data += chunk;
+        length -= chunk;
+        tail = 0;
+    }
+    StreamListen (s);
+}
+
+// Decode the request: only GET /sensor/stream is accepted, and the
+// remainder of the request is ignored.
+//
+static void StreamStart (StreamSubscriber *s) {
+
+    static const char path[] = "/sensor/stream";
+    const char *uri;
+
+    if (strncmp (s->request, "GET ", 4)) goto invalid;
+    uri = s->request + 4;
+    if (strncmp (uri, path, sizeof(path)-1)) goto invalid;
+    uri += sizeof(path) - 1;
+    if (*uri != ' ' && *uri != '?') goto invalid;
+
+    s->queue = malloc (StreamQueueSize);
+    if (!s->queue) {
+        fprintf (stderr, "No enough memory for a stream queue\n");
+        exit (1);
+    }
+    s->head = 0;
+    s->count = 0;
+    s->streaming = 1;
+    StreamSubscriberCount += 1;
+    if (echttp_isdebug())
+        printf ("Stream subscriber %d connected\n", s->fd);
+    StreamSend (s, StreamHeader, sizeof(StreamHeader)-1);
+    return;
+
+invalid:
+    send (s->fd, StreamNotFound, sizeof(StreamNotFound)-1,
+          MSG_NOSIGNAL|MSG_DONTWAIT);
+    StreamClose (s);
+}
+
+static void StreamReceive (int fd, int mode) {
+
+    StreamSubscriber *s = StreamSearch (fd);
+    char discard[256];
+    int length;
+
+    if (!s) return;
+
+    if ((mode & 2) && s->streaming) {
+        if (!StreamFlush (s)) return;
+    }
+    if (!(mode & 1)) return;
+
+    if (s->streaming) {
+        // Nothing more is expected from a subscriber, but the end of
+        // the connection.
+        //
+        length = recv (fd, discard, sizeof(discard), MSG_DONTWAIT);
+        if (length == 0 ||
+            (length < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+            StreamClose (s);
+        return;
+    }
+
+    length = recv (fd, s->request + s->received,
+                   sizeof(s->request) - s->received - 1, MSG_DONTWAIT);
+    if (length <= 0) {
+        if (length == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+            StreamClose (s);
+        return;
+    }
+    s->received += length;
+    s->request[s->received] = 0;
+
+    if (strstr (s->request, "\r\n\r\n") || strstr (s->request, "\n\n")) {
+        StreamStart (s);
+    } else if (s->received >= sizeof(s->request) - 1) {
+        StreamClose (s);
+    }
+}
+
+static void StreamAccept (int fd, int mode) {
+
+    StreamSubscriber *s = 0;
+    int client;
+    int i;
+
+    client = accept (fd, 0, 0);
+    if (client < 0) return;
+
+    for (i = 0; i < StreamSubscriberSize; ++i) {
+        if (StreamSubscribers[i].fd < 0) {
+            s = StreamSubscribers + i;
+            break;
+        }
+    }
+    if (!s) {
+        if (StreamSubscriberSize >= StreamSubscriberLimit) {
+            StreamRejected += 1;
+            close (client);
+            return;
+        }
+        StreamSubscriberSize += 1;
+        StreamSubscribers = realloc (StreamSubscribers,
+                                 sizeof(StreamSubscriber)*StreamSubscriberSize);
+        if (!StreamSubscribers) {
+            fprintf (stderr, "No enough memory for %d subscribers\n",
+                     StreamSubscriberSize);
+            exit (1);
+        }
+        s = StreamSubscribers + StreamSubscriberSize - 1;
+    }
+    memset (s, 0, sizeof(StreamSubscriber));
+    s->fd = client;
+    s->active = time(0);
+    fcntl (client, F_SETFD, FD_CLOEXEC);
+    fcntl (client, F_SETFL, fcntl (client, F_GETFL) | O_NONBLOCK);
+    echttp_listen (client, 1, StreamReceive, 0);
+}
+
+static int StreamOpen (int family, int port) {
+
+    struct sockaddr_in6 address6;
+    struct sockaddr_in address4;
+    struct sockaddr *address;
+    socklen_t length;
+    int value = 1;
+    int fd = socket (family, SOCK_STREAM|SOCK_CLOEXEC, 0);
+
+    if (fd < 0) return -1;
+    setsockopt (fd, SOL_SOCKET, SO_REUSEADDR, &value, sizeof(value));
+
+    if (family == AF_INET6) {
+        setsockopt (fd, IPPROTO_IPV6, IPV6_V6ONLY, &value, sizeof(value));
+        memset (&address6, 0, sizeof(address6));
+        address6.sin6_family = AF_INET6;
+        address6.sin6_addr = in6addr_any;
+        address6.sin6_port = htons(port);
+        address = (struct sockaddr *)&address6;
+        length = sizeof(address6);
+    } else {
+        memset (&address4, 0, sizeof(address4));
+        address4.sin_family = AF_INET;
+        address4.sin_addr.s_addr = INADDR_ANY;
+        address4.sin_port = htons(port);
+        address = (struct sockaddr *)&address4;
+        length = sizeof(address4);
+    }
+    if (bind (fd, address, length) < 0 || listen (fd, 16) < 0) {
+        close (fd);
+        return -1;
+    }
+    if (getsockname (fd, address, &length) == 0) {
+        StreamPort = ntohs ((family == AF_INET6) ?
+                                address6.sin6_port : address4.sin_port);
+    }
+    return fd;
+}
+
+void housesensor_stream_initialize (int argc, const char **argv) {
+
+    const char *port = housesensor_db_option ("stream.port");
+    const char *queue = housesensor_db_option ("stream.queue");
+    const char *limit = housesensor_db_option ("stream.subscribers");
+
+    if (queue) {
+        StreamQueueSize = atoi(queue);
+        if (StreamQueueSize < 4096) StreamQueueSize = 4096;
+    }
+    if (limit) StreamSubscriberLimit = atoi(limit);
+    if (StreamSubscriberLimit <= 0) return;
+
+    // Listen on the same addresses as the web server, i.e. only for the
+    // IP versions it listens on, and using the same port for both.
+    //
+    StreamPort = port ? atoi(port) : 0;
+    if (echttp_port (4)) StreamSocket4 = StreamOpen (AF_INET, StreamPort);
+    if (echttp_port (6)) StreamSocket6 = StreamOpen (AF_INET6, StreamPort);
+    if (StreamSocket4 < 0 && StreamSocket6 < 0) {
+        fprintf (stderr, "Cannot open the stream socket: %s\n",
+                 strerror(errno));
+        StreamPort = 0;
+        return;
+    }
+    if (StreamSocket4 >= 0) echttp_listen (StreamSocket4, 1, StreamAccept, 0);
+    if (StreamSocket6 >= 0) echttp_listen (StreamSocket6, 1, StreamAccept, 0);
+    if (echttp_isdebug())
+        printf ("Streaming measurements on port %d\n", StreamPort);
+}
+
+int housesensor_stream_port (void) {
+    return StreamPort;
+}
+
+int housesensor_stream_active (void) {
+    return StreamSubscriberCount;
+}
+
+void housesensor_stream_publish (long long id, const char *data, int length) {
+
+    static housesensor_output event;
+    int i;
+
+    if (StreamSubscriberCount <= 0) return;
+
+    housesensor_output_reset (&event, 0);
+    housesensor_output_printf (&event, "id: %lld\ndata: ", id);
+    housesensor_output_append (&event, data, length);
+    housesensor_output_append (&event, "\n\n", 2);
+
+    for (i = 0; i < StreamSubscriberSize; ++i) {
+        StreamSubscriber *s = StreamSubscribers + i;
+        if (s->fd < 0 || !s->streaming) continue;
+        StreamSend (s, event.data, event.length);
+    }
+    StreamPublished += 1;
+}
+
+void housesensor_stream_metrics (void) {
+
+    housesensor_metrics_declare ("housesensor_stream_subscribers", "gauge",
+                                 "Clients subscribed to /sensor/stream.");
+    housesensor_metrics_value (0, 0, StreamSubscriberCount);
+
+    housesensor_metrics_declare ("housesensor_stream_events_total", "counter",
+                                 "Measurements pushed to the subscribers.");
+    housesensor_metrics_value (0, 0, StreamPublished);
+
+    housesensor_metrics_declare ("housesensor_stream_dropped_total",
+                                 "counter",
+                                 "Subscribers disconnected for being slow.");
+    housesensor_metrics_value (0, 0, StreamDropped);
+
+    housesensor_metrics_declare ("housesensor_stream_rejected_total",
+                                 "counter",
+                                 "Connections refused, too many clients.");
+    housesensor_metrics_value (0, 0, StreamRejected);
+}
+
+void housesensor_stream_background (time_t now) {
+
+    static const char keepalive[] = ":\n\n";
+    int i;
+
+    for (i = 0; i < StreamSubscriberSize; ++i) {
+        StreamSubscriber *s = StreamSubscribers + i;
+        if (s->fd < 0) continue;
+        if (!s->streaming) {
+            if (now > s->active + STREAM_REQUEST) StreamClose (s);
+        } else if (s->count == 0 && now >= s->active + STREAM_KEEPALIVE) {
+            StreamSend (s, keepalive, sizeof(keepalive)-1);
+        }
+    }
+}
@@ -0,0 +1,30 @@
+/* housesensor - A simple home web server for measurements.
+ *
+ * Copyright 2019, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housesensor_stream.h - Push the new measurements to subscribers.
+ */
+void housesensor_stream_initialize (int argc, const char **argv);
+int  housesensor_stream_port (void);
+
+int  housesensor_stream_active (void);
+void housesensor_stream_publish (long long id, const char *data, int length);
+
+void housesensor_stream_metrics (void);
+void housesensor_stream_background (time_t now);
@@ -22,18 +22,156 @@
  *
  * SYNOPSYS:
  *
+ * void housesensor_w1_initialize (int argc, const char **argv);
+ *
+ *    Resolve the list of 1-Wire devices and start the acquisition thread.
+ *
+ * void housesensor_w1_background (time_t now);
+ *
+ *    Request a read of each device for which the scan period has elapsed.
+ *    If the configuration was reloaded, resolve the list of devices again
+ *    first: the devices that were added start to be read, the devices that
+ *    were removed are no longer read, and the others are not disturbed.
+ *
+ * void housesensor_w1_metrics (void);
+ *
+ *    Report the read latency and errors for each device, and the scan
+ *    duration and overruns for each bus (see housesensor_metrics.c).
+ *
+ * Each device is read according to its own scan period: this is the
+ * w1.scan.period option, unless a w1.scan.period.<id> option is defined
+ * for this device. The devices are kept in a heap ordered by deadline,
+ * and the first reads are staggered across the period, to smooth the
+ * load on the bus. (In bulk mode the reads are not staggered, so that
+ * the devices of a bus can share the same conversion.)
+ *
+ * Reading a DS18x20 sensor blocks for the duration of the temperature
+ * conversion (up to 750ms), so the devices are read by separate threads:
+ * one per 1-Wire bus master, so that the buses are scanned concurrently.
+ * The devices that could not be associated with a bus master at startup
+ * are read by one additional thread.
+ *
+ * If option w1.scan.mode is set to "bulk", the conversion is triggered
+ * on all sensors of a bus master at once (see therm_bulk_read in the
+ * Linux w1_therm documentation), and each sensor's last converted value
+ * is then read back. A scan then takes one conversion time per bus
+ * instead of one per sensor. The devices for which this fails fall back
+ * to the individual conversion.
+ * These threads only access the sysfs files: the measurements are sent
+ * back to the main thread through a pipe, and stored in the database
+ * from the main loop.
  */
 
+#include <pthread.h>
+#include <fcntl.h>
+#include <errno.h>
+
 #include "echttp_libc.h"
 
 #include "housesensor.h"
 #include "housesensor_w1.h"
 #include "housesensor_db.h"
+#include "housesensor_metrics.h"
 
 
 static const char *DS1820[] = {"10-", "28-", 0};
 static int ScanPeriod = 10;
 
+// The minimum scan period, for all devices or for a single device. A read
+// may block for the duration of a conversion (up to 750ms) and a bus is
+// read one device at a time, so a shorter period would only lead to
+// overruns.
+//
+#define W1_PERIOD_MINIMUM 5
+static int ScanBulk = 0;
+
+static const char *W1Root = "/sys/bus/w1/devices";
+
+// The maximum time to wait for a bulk conversion, in milliseconds.
+// This covers the 750ms conversion time of a DS18B20 at 12 bits.
+//
+#define W1_BULK_TIMEOUT 1500
+
+typedef struct W1Bus W1Bus;
+
+// The devices are allocated individually and never freed, so that
+// the bus threads can keep a pointer to a device while the list of
+// devices is updated. A device that is no longer in the configuration
+// is only marked as removed.
+//
+typedef struct {
+    const char *id;
+    int handle;
+    W1Bus *bus;
+    int period;
+    time_t deadline; // Only accessed from the main thread.
+    int pending;     // Only accessed from the main thread.
+    int removed;     // Only accessed from the main thread.
+    int ds1820;
+    int fd;          // The open w1_slave file, or -1.
+    housesensor_histogram latency;
+    long long errors[4]; // Per read status, see below.
+} W1Device;
+
+// Each bus has a queue of devices to read, filled by the main thread
+// and emptied by the bus thread. Since a device is never queued again
+// before it was read, this queue never holds more than count devices.
+//
+struct W1Bus {
+    char name[32];  // Empty for the devices with no known bus master.
+    int  count;     // Devices attached to this bus, including removed.
+
+    // The queue, protected by W1ScanLock. It can hold up to size devices.
+    //
+    W1Device **queue;
+    int  size;
+    int  head;
+    int  tail;
+    pthread_cond_t wakeup;
+    int  running;   // A thread was started for this bus (main thread).
+
+    // The metrics, only accessed from the main thread. A scan starts
+    // when a device is queued on an idle bus, and ends when all queued
+    // devices have been read.
+    //
+    int pending;
+    long long started;
+    long long overruns;
+    housesensor_histogram duration;
+};
+
+static W1Bus **W1Buses = 0;
+static int W1BusCount = 0;
+
+static W1Device **W1Devices = 0;
+static int W1DeviceCount = 0;
+static int W1DeviceSize = 0;
+
+// The read schedule: a heap of the active devices, ordered by deadline.
+//
+static W1Device **W1Schedule = 0;
+static int W1ScheduleCount = 0;
+
+// The configuration generation the devices were resolved from.
+//
+static long W1Generation = 0;
+
+#define W1_OK       0
+#define W1_FAILED   1 // The device could not be accessed, or was not parsed.
+#define W1_CRC      2 // The device reported a CRC error.
+#define W1_BADVALUE 3 // The device reported a known error value.
+
+typedef struct {
+    W1Device *device;
+    int  status;
+    long value;   // In thousandths of a degree.
+    long latency; // In microseconds.
+} W1Result;
+
+static int W1ResultPipe[2] = {-1, -1};
+
+static pthread_mutex_t W1ScanLock = PTHREAD_MUTEX_INITIALIZER;
+
 static int BelongsTo (const char *id, const char **list) {
     int i;
     for (i = 0; list[i]; ++i) {
@@ -42,78 +180,624 @@ static int BelongsTo (const char *id, const char **list) {
     return 0;
 }
 
-static void ReadDevice (const char *id) {
+static void PostResult (const W1Device *device,
+                        int status, long value, long latency) {
 
-    char name [1024];
-    char line[80];
-    char *p;
-    char *eol;
-    FILE *f;
+    W1Result result;
+
+    // 85000 and 127937 are two known "error values" that
+    // seem to be related to a chip reset (power issue?).
+    // Ignore either one.
+    //
+    if (status == W1_OK && (value == 85000 || value == 127937))
+        status = W1_BADVALUE;
+
+    result.device = (W1Device *)device;
+    result.status = status;
+    result.value = value;
+    result.latency = latency;
+
+    // A write of less than PIPE_BUF bytes is atomic: there is never
+    // a partial result in the pipe.
+    //
+    if (write (W1ResultPipe[1], &result, sizeof(result)) != sizeof(result)) {
+        if (echttp_isdebug()) printf ("    .. cannot post result\n");
+    }
+}
+
+// Parse the content of a w1_slave file, which looks like:
+//    72 01 4b 46 7f ff 0e 10 57 : crc=57 YES
+//    72 01 4b 46 7f ff 0e 10 57 t=23125
+//
+static int ParseDevice (const char *data, int length, long *value) {
+
+    const char *end = data + length;
+    const char *eol = memchr (data, '\n', length);
+    const char *p;
+    long number = 0;
+    int negative = 0;
+
+    if (!eol || eol - data < 4) return W1_FAILED;
+    if (memcmp (eol - 4, " YES", 4)) return W1_CRC;
+
+    for (p = eol + 1; p + 2 < end; ++p) {
+        if (p[0] == 't' && p[1] == '=') break;
+    }
+    if (p + 2 >= end) return W1_FAILED;
+    p += 2;
+
+    if (*p == '-') {
+        negative = 1;
+        p += 1;
+    }
+    if (p >= end || *p < '0' || *p > '9') return W1_FAILED;
+    while (p < end && *p >= '0' && *p <= '9')
+        number = (number * 10) + (*(p++) - '0');
+
+    *value = negative ? -number : number;
+    return W1_OK;
+}
+
+// The w1_slave file is kept open: each read at offset 0 triggers a new
+// conversion. The file is closed on error, and opened again on the next
+// read. A file that cannot be read at an offset (not a sysfs file) is
+// closed after each read.
+//
+static int ReadDevice (W1Device *device, long *value) {
+
+    char data[128];
+    int length;
+
+    if (!device->ds1820) return W1_FAILED;
 
-    snprintf (name, sizeof(name), "/sys/bus/w1/devices/%s/w1_slave", id);
     if (echttp_isdebug())
-        printf ("Scanning %s at %lld\n", name, (long long)time(0));
-
-    f = fopen (name, "r");
-    if (f) {
-        fgets (line, sizeof(line), f);
-        if (strstr (line, " YES")) {
-            fgets (line, sizeof(line), f);
-            if (BelongsTo (id, DS1820)) {
-                char value[8];
-                p = strstr(line, " t=");
-                if (p) {
-                    for (eol = p; *eol > 0; ++eol) {
-                        if (*eol < ' ') {
-                            *eol = 0;
-                            break;
-                        }
-                    }
-                    strtcpy(value, p+3, sizeof(value));
-
-                    // 85000 and 127937 are two known "error values" that
-                    // seem to be related to a chip reset (power issue?).
-                    // Ignore either one.
-                    //
-                    if (strcmp (value, "85000") && strcmp (value, "127937")) {
-                        p = value + strlen(value)-3;
-                        p[4] = 0;
-                        p[3] = p[2];
-                        p[2] = p[1];
-                        p[1] = p[0];
-                        p[0] = '.';
-                        p = value + strlen(value);
-                        while (*(--p) == '0') *p = 0;
-                        if (*p == '.') *p = 0; // No more fraction.
-                        housesensor_db_set ("w1", id, value, "°C");
-                    }
-                }
+        printf ("Scanning %s at %lld\n", device->id, (long long)time(0));
+
+    if (device->fd < 0) {
+        char name[1024];
+        snprintf (name, sizeof(name), "%s/%s/w1_slave", W1Root, device->id);
+        device->fd = open (name, O_RDONLY|O_CLOEXEC);
+        if (device->fd < 0) {
+            if (echttp_isdebug()) printf ("    .. Not found\n");
+            return W1_FAILED;
+        }
+    }
+
+    length = pread (device->fd, data, sizeof(data), 0);
+    if (length < 0 && errno == ESPIPE) {
+        length = read (device->fd, data, sizeof(data));
+        close (device->fd);
+        device->fd = -1;
+    }
+    if (length <= 0) {
+        if (device->fd >= 0) close (device->fd);
+        device->fd = -1;
+        return W1_FAILED;
+    }
+    return ParseDevice (data, length, value);
+}
+
+// Find which bus master a device is attached to, and add the device
+// to that bus. The sysfs entry for the device is a symbolic link to
+// .../w1_bus_masterN/<id>.
+//
+static void AttachDevice (W1Device *device) {
+
+    char name[1024];
+    char target[1024];
+    char *master = "";
+    W1Bus *bus;
+    int length;
+    int i;
+
+    snprintf (name, sizeof(name), "%s/%s", W1Root, device->id);
+    length = readlink (name, target, sizeof(target)-1);
+    if (length > 0) {
+        target[length] = 0;
+        master = strstr (target, "w1_bus_master");
+        if (master) {
+            char *end = strchr (master, '/');
+            if (end) *end = 0;
+        } else {
+            master = "";
+        }
+    }
+
+    for (i = 0; i < W1BusCount; ++i) {
+        if (strcmp (W1Buses[i]->name, master) == 0) break;
+    }
+    if (i >= W1BusCount) {
+        W1Buses = realloc (W1Buses, sizeof(W1Bus *)*(W1BusCount+1));
+        bus = calloc (1, sizeof(W1Bus));
+        if (!W1Buses || !bus) {
+            fprintf (stderr, "No enough memory for %d buses\n", W1BusCount+1);
+            exit (1);
+        }
+        W1Buses[W1BusCount++] = bus;
+        strtcpy (bus->name, master, sizeof(bus->name));
+        pthread_cond_init (&bus->wakeup, 0);
+        if (echttp_isdebug())
+            printf ("Found 1-Wire bus master '%s'\n", master);
+    }
+    device->bus = W1Buses[i];
+    W1Buses[i]->count += 1;
+}
+
+// Start a conversion on all the sensors of a bus master and wait for
+// its completion. Return 1 on success, 0 if bulk conversion is not
+// available on this bus.
+//
+static int ConvertMaster (const W1Bus *bus) {
+
+    char name[1024];
+    char status[8];
+    int elapsed;
+    int fd;
+
+    snprintf (name, sizeof(name),
+              "%s/%s/therm_bulk_read", W1Root, bus->name);
+    if (echttp_isdebug())
+        printf ("Converting %s at %lld\n", name, (long long)time(0));
+
+    fd = open (name, O_RDWR);
+    if (fd < 0) return 0;
+
+    if (write (fd, "trigger\n", 8) != 8) {
+        close (fd);
+        return 0;
+    }
+
+    // The status reads -1 while a conversion is in progress.
+    //
+    for (elapsed = 0; elapsed < W1_BULK_TIMEOUT; elapsed += 10) {
+        int length = pread (fd, status, sizeof(status)-1, 0);
+        if (length <= 0) break;
+        status[length] = 0;
+        if (atoi(status) >= 0) {
+            close (fd);
+            return 1;
+        }
+        usleep (10000);
+    }
+    close (fd);
+    return 0;
+}
+
+// Read the last converted value of a sensor after a bulk conversion.
+// Return 0 if the value could not be read.
+//
+static int ReadConverted (const W1Device *device, long *value) {
+
+    char name[1024];
+    char line[32];
+    char *end;
+    int length;
+    int fd;
+
+    snprintf (name, sizeof(name), "%s/%s/temperature", W1Root, device->id);
+    if (echttp_isdebug())
+        printf ("Reading %s at %lld\n", name, (long long)time(0));
+
+    fd = open (name, O_RDONLY);
+    if (fd < 0) return 0;
+    length = read (fd, line, sizeof(line)-1);
+    close (fd);
+    if (length <= 0) return 0;
+    line[length] = 0;
+
+    *value = strtol (line, &end, 10);
+    return (end > line);
+}
+
+static void ScanBus (const W1Bus *bus, W1Device **devices, int count) {
+
+    int converted = 0;
+    int i;
+
+    if (ScanBulk && bus->name[0]) {
+        for (i = 0; i < count; ++i) {
+            if (devices[i]->ds1820) {
+                converted = ConvertMaster (bus);
+                break;
             }
         }
-        fclose(f);
     }
-    else if (echttp_isdebug()) printf ("    .. Not found\n");
+    for (i = 0; i < count; ++i) {
+        W1Device *device = devices[i];
+        long long start = housesensor_metrics_now ();
+        long value = 0;
+        int status = W1_OK;
+        if (!converted || !ReadConverted (device, &value))
+            status = ReadDevice (device, &value); // Individual.
+        PostResult (device, status, value,
+                    (long)(housesensor_metrics_now () - start));
+    }
 }
 
-void housesensor_w1_initialize (int argc, const char **argv) {
+static void *ScanThread (void *context) {
+
+    W1Bus *bus = (W1Bus *)context;
+    W1Device **devices = 0;
+    int size = 0;
+    int count;
+
+    for (;;) {
+        pthread_mutex_lock (&W1ScanLock);
+        while (bus->head == bus->tail)
+            pthread_cond_wait (&bus->wakeup, &W1ScanLock);
+        if (size < bus->size) {
+            // Devices were added to this bus.
+            size = bus->size;
+            devices = realloc (devices, size * sizeof(W1Device *));
+            if (!devices) {
+                fprintf (stderr, "No enough memory for bus %s\n", bus->name);
+                exit (1);
+            }
+        }
+        for (count = 0; bus->head != bus->tail; ++count) {
+            devices[count] = bus->queue[bus->head];
+            if (++(bus->head) > bus->size) bus->head = 0;
+        }
+        pthread_mutex_unlock (&W1ScanLock);
+
+        ScanBus (bus, devices, count);
+    }
+    return 0;
+}
+
+// Close the file of a device that was removed. This is done from the
+// main thread, when the device is not being read.
+//
+static void CloseDevice (W1Device *device) {
+    if (device->fd < 0) return;
+    close (device->fd);
+    device->fd = -1;
+}
+
+static void ReceiveResults (int fd, int mode) {
+
+    W1Result results[64];
+    int length;
+    int i;
+
+    while ((length = read (fd, results, sizeof(results))) > 0) {
+        int count = length / sizeof(W1Result);
+        for (i = 0; i < count; ++i) {
+            W1Device *device = results[i].device;
+            W1Bus *bus = device->bus;
+            device->pending = 0;
+            housesensor_metrics_observe (&device->latency, results[i].latency);
+            if (--(bus->pending) == 0)
+                housesensor_metrics_observe
+                    (&bus->duration, housesensor_metrics_now() - bus->started);
+            if (results[i].status != W1_OK) {
+                device->errors[results[i].status] += 1;
+                if (device->removed) CloseDevice (device);
+                continue;
+            }
+            if (device->removed) {
+                CloseDevice (device);
+                continue;
+            }
+            housesensor_db_set_number (device->handle,
+                                       results[i].value, 3, "°C");
+        }
+    }
+}
+
+static int ScheduleBefore (int a, int b) {
+    return W1Schedule[a]->deadline < W1Schedule[b]->deadline;
+}
+
+static void ScheduleSwap (int a, int b) {
+    W1Device *device = W1Schedule[a];
+    W1Schedule[a] = W1Schedule[b];
+    W1Schedule[b] = device;
+}
+
+static void ScheduleUp (int i) {
+    while (i > 0 && ScheduleBefore (i, (i-1)/2)) {
+        ScheduleSwap (i, (i-1)/2);
+        i = (i-1)/2;
+    }
+}
+
+static void ScheduleDown (int i) {
+    for (;;) {
+        int first = i;
+        int left = 2*i + 1;
+        int right = left + 1;
+        if (left < W1ScheduleCount && ScheduleBefore (left, first))
+            first = left;
+        if (right < W1ScheduleCount && ScheduleBefore (right, first))
+            first = right;
+        if (first == i) return;
+        ScheduleSwap (i, first);
+        i = first;
+    }
+}
+
+static void ScheduleDevice (W1Device *device) {
+
+    W1Bus *bus = device->bus;
+
+    if (device->pending) {
+        if (echttp_isdebug())
+            printf ("Device %s is still being read, skipped\n", device->id);
+        bus->overruns += 1;
+        return;
+    }
+    device->pending = 1;
+    if (bus->pending++ == 0) bus->started = housesensor_metrics_now ();
+
+    bus->queue[bus->tail] = device;
+    if (++(bus->tail) > bus->size) bus->tail = 0;
+}
+
+// Make room in the queue of a bus for all the devices attached to it.
+// The queue content is kept, in order. Must be called with W1ScanLock.
+//
+static void ReserveBus (W1Bus *bus) {
+
+    W1Device **queue;
+    int count = 0;
+
+    if (bus->size >= bus->count) return;
+
+    queue = calloc (bus->count + 1, sizeof(W1Device *));
+    if (!queue) {
+        fprintf (stderr, "No enough memory for bus %s\n", bus->name);
+        exit (1);
+    }
+    while (bus->head != bus->tail) {
+        queue[count++] = bus->queue[bus->head];
+        if (++(bus->head) > bus->size) bus->head = 0;
+    }
+    free (bus->queue);
+    bus->queue = queue;
+    bus->size = bus->count;
+    bus->head = 0;
+    bus->tail = count;
+}
+
+static int CompareDevices (const void *a, const void *b) {
+    return strcmp ((*(W1Device **)a)->id, (*(W1Device **)b)->id);
+}
+
+static int SearchDevice (const void *key, const void *b) {
+    return strcmp ((const char *)key, (*(W1Device **)b)->id);
+}
+
+static void LoadOptions (void) {
+
+    const char *mode = housesensor_db_option ("w1.scan.mode");
     const char *period = housesensor_db_option ("w1.scan.period");
+
+    ScanPeriod = 10;
     if (period) {
         ScanPeriod = atoi(period);
-        if (ScanPeriod <= 5) ScanPeriod = 5;
+        if (ScanPeriod < W1_PERIOD_MINIMUM) ScanPeriod = W1_PERIOD_MINIMUM;
+    }
+    ScanBulk = (mode && strcmp (mode, "bulk") == 0);
+}
+
+// Resolve each device once, so that a scan does not have to search
+// the sensor database for every measurement. This is done again when
+// the configuration changes: the devices that remain keep their
+// schedule, and the new devices are scheduled from now.
+//
+static void ResolveDevices (time_t now) {
+
+    W1Device **known = 0;
+    int knowncount = W1DeviceCount;
+    int added = 0;
+    int staggered = 0;
+    const char *id;
+    int i;
+
+    LoadOptions ();
+
+    if (knowncount > 0) {
+        known = malloc (knowncount * sizeof(W1Device *));
+        if (!known) {
+            fprintf (stderr, "No enough memory for %d devices\n", knowncount);
+            exit (1);
+        }
+        memcpy (known, W1Devices, knowncount * sizeof(W1Device *));
+        qsort (known, knowncount, sizeof(W1Device *), CompareDevices);
+    }
+    for (i = 0; i < W1DeviceCount; ++i) W1Devices[i]->removed = 1;
+
+    for (id = housesensor_db_device_first("w1");
+         id; id = housesensor_db_device_next("w1")) {
+
+        W1Device *device = 0;
+
+        if (known) {
+            W1Device **found = bsearch (id, known, knowncount,
+                                        sizeof(W1Device *), SearchDevice);
+            if (found) device = *found;
+        }
+        if (!device) {
+            if (W1DeviceCount >= W1DeviceSize) {
+                W1DeviceSize += 64;
+                W1Devices =
+                    realloc (W1Devices, sizeof(W1Device *)*W1DeviceSize);
+                if (!W1Devices) {
+                    fprintf (stderr,
+                             "No enough memory for %d devices\n", W1DeviceSize);
+                    exit (1);
+                }
+            }
+            device = calloc (1, sizeof(W1Device));
+            if (!device) {
+                fprintf (stderr, "No enough memory for device %s\n", id);
+                exit (1);
+            }
+            device->id = id;
+            device->ds1820 = BelongsTo (id, DS1820);
+            device->fd = -1;
+            AttachDevice (device);
+            W1Devices[W1DeviceCount++] = device;
+            added += 1;
+        }
+        device->removed = 0;
+        device->handle = housesensor_db_handle ("w1", id);
     }
+    free (known);
+
+    for (i = 0; i < W1DeviceCount; ++i) {
+        if (W1Devices[i]->removed && !W1Devices[i]->pending)
+            CloseDevice (W1Devices[i]);
+    }
+
+    W1Schedule = realloc (W1Schedule, (W1DeviceCount+1) * sizeof(W1Device *));
+    if (!W1Schedule) {
+        fprintf (stderr, "No enough memory for %d devices\n", W1DeviceCount);
+        exit (1);
+    }
+    W1ScheduleCount = 0;
+    for (i = 0; i < W1DeviceCount; ++i) {
+        W1Device *d = W1Devices[i];
+        const char *period;
+        char name[256];
+
+        if (d->removed) continue;
+
+        snprintf (name, sizeof(name), "w1.scan.period.%s", d->id);
+        period = housesensor_db_option (name);
+        d->period = period ? atoi(period) : ScanPeriod;
+        if (d->period < W1_PERIOD_MINIMUM) d->period = W1_PERIOD_MINIMUM;
+
+        if (d->deadline == 0) {
+            d->deadline = now;
+            if (!ScanBulk)
+                d->deadline += (staggered++ * (long long)d->period) / added;
+        } else if (d->deadline > now + d->period) {
+            d->deadline = now + d->period; // The period was reduced.
+        }
+        W1Schedule[W1ScheduleCount] = d;
+        ScheduleUp (W1ScheduleCount++);
+    }
+
+    pthread_mutex_lock (&W1ScanLock);
+    for (i = 0; i < W1BusCount; ++i) ReserveBus (W1Buses[i]);
+    pthread_mutex_unlock (&W1ScanLock);
+
+    for (i = 0; i < W1BusCount; ++i) {
+        pthread_t thread;
+        if (W1Buses[i]->running) continue;
+        if (pthread_create (&thread, 0, ScanThread, W1Buses[i])) {
+            fprintf (stderr, "cannot create the 1-Wire scan thread\n");
+            exit (1);
+        }
+        pthread_detach (thread);
+        W1Buses[i]->running = 1;
+    }
+
+    W1Generation = housesensor_db_generation ();
+    if (echttp_isdebug())
+        printf ("Resolved %d 1-Wire devices, %d new\n",
+                W1ScheduleCount, added);
+}
+
+void housesensor_w1_initialize (int argc, const char **argv) {
+
+    const char *root = housesensor_db_option ("w1.root");
+
+    if (root) W1Root = root;
+
+    if (pipe (W1ResultPipe) < 0) {
+        fprintf (stderr, "cannot create the 1-Wire result pipe\n");
+        exit (1);
+    }
+    fcntl (W1ResultPipe[0], F_SETFL, O_NONBLOCK);
+    echttp_listen (W1ResultPipe[0], 1, ReceiveResults, 0);
+
+    ResolveDevices (time(0));
 }
 
 void housesensor_w1_background (time_t now) {
 
-    static time_t LastScan = 0;
-    const char *device;
+    int i;
+    int queued = 0;
+
+    if (housesensor_db_generation () != W1Generation) ResolveDevices (now);
 
-    if (now >= LastScan + ScanPeriod) {
-        for (device = housesensor_db_device_first("w1");
-             device; device = housesensor_db_device_next("w1")) {
-            ReadDevice (device);
+    if (W1ScheduleCount <= 0) return;
+
+    pthread_mutex_lock (&W1ScanLock);
+    while (W1Schedule[0]->deadline <= now) {
+        W1Device *device = W1Schedule[0];
+        ScheduleDevice (device);
+        queued = 1;
+
+        // Keep the staggering, unless the schedule was missed entirely.
+        //
+        device->deadline += device->period;
+        if (device->deadline <= now) device->deadline = now + device->period;
+        ScheduleDown (0);
+    }
+    if (queued) {
+        for (i = 0; i < W1BusCount; ++i) {
+            if (W1Buses[i]->head != W1Buses[i]->tail)
+                pthread_cond_signal (&W1Buses[i]->wakeup);
         }
-        LastScan = now;
     }
+    pthread_mutex_unlock (&W1ScanLock);
 }
 
+static const char *W1BusName (const W1Bus *bus) {
+    return bus->name[0] ? bus->name : "none";
+}
+
+void housesensor_w1_metrics (void) {
+
+    int i;
+
+    housesensor_metrics_declare ("housesensor_w1_read_seconds", "histogram",
+                                 "Time to read a 1-Wire device.");
+    for (i = 0; i < W1DeviceCount; ++i) {
+        if (W1Devices[i]->removed) continue;
+        housesensor_metrics_histogram ("device", W1Devices[i]->id,
+                                       &W1Devices[i]->latency);
+    }
+
+    housesensor_metrics_declare ("housesensor_w1_read_errors_total",
+                                 "counter",
+                                 "Reads that failed to access the device.");
+    for (i = 0; i < W1DeviceCount; ++i) {
+        if (W1Devices[i]->removed) continue;
+        housesensor_metrics_value ("device", W1Devices[i]->id,
+                                   W1Devices[i]->errors[W1_FAILED]);
+    }
+
+    housesensor_metrics_declare ("housesensor_w1_crc_errors_total", "counter",
+                                 "Reads that failed the CRC check.");
+    for (i = 0; i < W1DeviceCount; ++i) {
+        if (W1Devices[i]->removed) continue;
+        housesensor_metrics_value ("device", W1Devices[i]->id,
+                                   W1Devices[i]->errors[W1_CRC]);
+    }
+
+    housesensor_metrics_declare ("housesensor_w1_bad_values_total", "counter",
+                                 "Reads that returned 85000 or 127937.");
+    for (i = 0; i < W1DeviceCount; ++i) {
+        if (W1Devices[i]->removed) continue;
+        housesensor_metrics_value ("device", W1Devices[i]->id,
+                                   W1Devices[i]->errors[W1_BADVALUE]);
+    }
+
+    housesensor_metrics_declare ("housesensor_w1_scan_seconds", "histogram",
+                                 "Time to read the devices queued on a bus.");
+    for (i = 0; i < W1BusCount; ++i)
+        housesensor_metrics_histogram ("bus", W1BusName (W1Buses[i]),
+                                       &W1Buses[i]->duration);
+
+    housesensor_metrics_declare ("housesensor_w1_scan_overruns_total",
+                                 "counter",
+                                 "Reads skipped, the previous one not done.");
+    for (i = 0; i < W1BusCount; ++i)
+        housesensor_metrics_value ("bus", W1BusName (W1Buses[i]),
+                                   W1Buses[i]->overruns);
+}
@@ -25,3 +25,5 @@ void housesensor_w1_initialize (int argc, const char **argv);
 
 void housesensor_w1_background (time_t now);
 
+void housesensor_w1_metrics (void);
+